@@ -14,170 +14,744 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* Estimate how well a set of files would de-duplicate in an archive under
+ * several chunking configurations at once, so that the parameters can be
+ * chosen before storing a large data set.
+ *
+ * Usage: analyze [-c target,minimum,maximum[,window]]... [-m MiB] [-T dir]
+ *		  [-l] file...
+ *
+ * The files are read once, each as a separate member. Every configuration
+ * finds the same chunk boundaries as scan.c would with its parameters, and
+ * counts its unique chunks by the first 64 bits of their SHA-256 in a hash
+ * table of its own. When a table outgrows its share of the -m MiB, its
+ * contents are sorted and spilled to a temporary file in dir as a run, and
+ * the runs are merged at the end. The rolling hash only depends on the
+ * window size, so it is computed once for each window size, and the
+ * configurations then each chunk and hash the data on a thread of their own.
+ *
+ * Prints CSV with a line for each configuration, by default only ddar's own.
+ * With -l and a single configuration, prints each chunk as
+ * sha256,offset,length instead, in the same form as test/expected.1. */
+
+#define _XOPEN_SOURCE 600
+#define _FILE_OFFSET_BITS 64
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <inttypes.h>
-#include <byteswap.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
-#include "sqlite3.h"
 #include "sha2.h"
-#include "scan.h"
+#include "rabin.h"
+
+#if defined(_POSIX_ADVISORY_INFO) && (_POSIX_ADVISORY_INFO > 0)
+# define HAVE_POSIX_FADVISE
+#endif
+
+/* ddar's own parameters, as scan_init() sets them */
+#define DEFAULT_TARGET (1 << 18)
+#define DEFAULT_MINIMUM (1 << 16)
+#define DEFAULT_MAXIMUM (1 << 24)
+#define DEFAULT_WINDOW 48
+
+#define MAX_CONFIGS 16
+#define MAX_WINDOW 4096
+#define BLOCK_SIZE (1 << 20)
+#define DEFAULT_MEMORY_MIB 1024
+
+/* Tables start this small and double until they reach their share of the
+ * memory, so that small inputs do not touch it all */
+#define TABLE_MIN_CAPACITY 1024
+
+/* Entries read at a time from each run when merging */
+#define RUN_BUFFER_ENTRIES 4096
+
+/* Bytes of archive database for each chunk row, with its indexes, and for
+ * each object row, as measured with ddar's schema and SQLite's defaults */
+#define CHUNK_ROW_BYTES 116
+#define OBJECT_ROW_BYTES 93
+
+struct table_entry {
+    uint64_t fingerprint; /* never 0, which marks an empty slot */
+    uint32_t length;
+} __attribute__((packed));
+
+/* A sorted run of entries spilled to disk */
+struct run {
+    off_t offset;
+    size_t count;
+    struct table_entry *buffer;
+    size_t buffered, next;
+};
+
+struct chunk_table {
+    struct table_entry *slots;
+    size_t capacity, max_capacity, count;
+
+    int spill_fd; /* -1 until the first spill */
+    off_t spill_offset;
+    struct run *runs;
+    int nruns;
+};
+
+struct window {
+    int size;
+    struct rabin_ctx *rabin;
+    uint32_t hash; /* of the window ending at the start of the block */
+    uint32_t *hashes; /* hashes[i] is of the window ending at block byte i */
+};
+
+struct analyze_ctx;
+
+struct config {
+    struct analyze_ctx *analyze;
+    int target, minimum, maximum;
+    struct window *window;
+    pthread_t thread;
+
+    /* Offsets in the current file of the chunk being found, and of how far
+     * into it has been hashed */
+    uint64_t chunk_start, hashed;
+    sha256_ctx sha256;
+
+    uint64_t bytes, chunks;
+    struct chunk_table table;
+};
 
 struct analyze_ctx {
-    sqlite3 *db;
-    sqlite3_stmt *db_insert_stmt;
-    int64_t offset;
+    struct config configs[MAX_CONFIGS];
+    int nconfigs;
+    struct window windows[MAX_CONFIGS];
+    int nwindows;
+
+    /* The block being chunked, at buffer + history, preceded by the last
+     * history bytes of the file before it, or zeroes */
+    unsigned char *buffer;
+    int history;
+    uint64_t base; /* offset in the file of the block */
+    int n;
+    int last; /* if the block ends the file */
+    int stop; /* if the threads should exit */
+
+    /* Every thread waits at start until a block is ready, and at done until
+     * all have finished with it */
+    pthread_barrier_t start, done;
+
+    int list;
+    const char *tmpdir;
 };
 
-static void print_sqlite3_error(sqlite3 *db) {
-    fputs("sqlite3: ", stderr);
-    fputs(sqlite3_errmsg(db), stderr);
-    fputc('\n', stderr);
+static void fail(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+static void *xmalloc(size_t size) {
+    void *p;
+
+    p = malloc(size);
+    if (!p)
+	fail("malloc");
+    return p;
+}
+
+/* Read until bytes_to_read bytes have been read or EOF, setting *eof in
+ * that case. Returns the number of bytes read or -1 on error. */
+static int read_fully(int fd, unsigned char *p, int bytes_to_read, int *eof) {
+    ssize_t result;
+    unsigned char *start, *end;
+
+    start = p;
+    end = p + bytes_to_read;
+    while (p < end) {
+	do {
+	    result = read(fd, p, end - p);
+	} while (result < 0 && errno == EINTR);
+	if (result < 0) {
+	    return -1;
+	} else if (!result) {
+	    *eof = 1;
+	    break;
+	}
+	p += result;
+    }
+    return p - start;
+}
+
+static void write_fully(int fd, const void *p, size_t size, off_t offset) {
+    ssize_t result;
+
+    while (size) {
+	do {
+	    result = pwrite(fd, p, size, offset);
+	} while (result < 0 && errno == EINTR);
+	if (result < 0)
+	    fail("spilling chunk table");
+	p = (const char *)p + result;
+	size -= result;
+	offset += result;
+    }
+}
+
+static void table_init(struct chunk_table *table, size_t memory) {
+    table->max_capacity = TABLE_MIN_CAPACITY;
+    while (table->max_capacity * 2 * sizeof(struct table_entry) <= memory)
+	table->max_capacity *= 2;
+    table->capacity = TABLE_MIN_CAPACITY;
+    table->count = 0;
+    table->slots = calloc(table->capacity, sizeof(struct table_entry));
+    if (!table->slots)
+	fail("calloc");
+    table->spill_fd = -1;
+    table->spill_offset = 0;
+    table->runs = 0;
+    table->nruns = 0;
+}
+
+/* Returns the slot holding fingerprint, or the empty one where it would
+ * go */
+static struct table_entry *table_find(struct chunk_table *table,
+				      uint64_t fingerprint) {
+    size_t mask = table->capacity - 1, i;
+
+    /* The fingerprint is from SHA-256, so its low bits will do as a hash */
+    i = fingerprint & mask;
+    while (table->slots[i].fingerprint &&
+	   table->slots[i].fingerprint != fingerprint)
+	i = (i + 1) & mask;
+    return &table->slots[i];
+}
+
+static void table_grow(struct chunk_table *table) {
+    struct table_entry *old = table->slots, *slot;
+    size_t old_capacity = table->capacity, i;
+
+    table->capacity *= 2;
+    table->slots = calloc(table->capacity, sizeof(struct table_entry));
+    if (!table->slots)
+	fail("calloc");
+    for (i=0; i<old_capacity; i++) {
+	if (old[i].fingerprint) {
+	    slot = table_find(table, old[i].fingerprint);
+	    *slot = old[i];
+	}
+    }
+    free(old);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint64_t x = ((const struct table_entry *)a)->fingerprint;
+    uint64_t y = ((const struct table_entry *)b)->fingerprint;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Write the table out as a sorted run and empty it */
+static void table_spill(struct chunk_table *table, const char *tmpdir) {
+    struct run *run;
+    size_t i, n = 0;
+    char *filename;
+
+    if (table->spill_fd < 0) {
+	filename = xmalloc(strlen(tmpdir) + sizeof("/ddar-analyze-XXXXXX"));
+	sprintf(filename, "%s/ddar-analyze-XXXXXX", tmpdir);
+	table->spill_fd = mkstemp(filename);
+	if (table->spill_fd < 0)
+	    fail(filename);
+	unlink(filename);
+	free(filename);
+    }
+
+    for (i=0; i<table->capacity; i++) {
+	if (table->slots[i].fingerprint)
+	    table->slots[n++] = table->slots[i];
+    }
+    qsort(table->slots, n, sizeof(struct table_entry), compare_entries);
+    write_fully(table->spill_fd, table->slots,
+		n * sizeof(struct table_entry), table->spill_offset);
+
+    table->runs = realloc(table->runs, (table->nruns + 1) *
+			  sizeof(struct run));
+    if (!table->runs)
+	fail("realloc");
+    run = &table->runs[table->nruns++];
+    run->offset = table->spill_offset;
+    run->count = n;
+    table->spill_offset += n * sizeof(struct table_entry);
+
+    memset(table->slots, 0, table->capacity * sizeof(struct table_entry));
+    table->count = 0;
+}
+
+static void table_insert(struct chunk_table *table, uint64_t fingerprint,
+			 uint32_t length, const char *tmpdir) {
+    struct table_entry *slot;
+
+    slot = table_find(table, fingerprint);
+    if (slot->fingerprint)
+	return;
+    /* Keep the load factor under 3/4 */
+    if (table->count + 1 > table->capacity / 4 * 3) {
+	if (table->capacity < table->max_capacity)
+	    table_grow(table);
+	else
+	    table_spill(table, tmpdir);
+	slot = table_find(table, fingerprint);
+    }
+    slot->fingerprint = fingerprint;
+    slot->length = length;
+    table->count++;
+}
+
+/* Returns the next entry of a run, or 0 at its end */
+static struct table_entry *run_peek(struct run *run, int fd) {
+    size_t n;
+    ssize_t result;
+
+    if (run->next == run->buffered) {
+	if (!run->count)
+	    return 0;
+	n = run->count < RUN_BUFFER_ENTRIES ? run->count : RUN_BUFFER_ENTRIES;
+	do {
+	    result = pread(fd, run->buffer, n * sizeof(struct table_entry),
+			   run->offset);
+	} while (result < 0 && errno == EINTR);
+	if (result != (ssize_t)(n * sizeof(struct table_entry)))
+	    fail("reading chunk table");
+	run->offset += result;
+	run->count -= n;
+	run->buffered = n;
+	run->next = 0;
+    }
+    return &run->buffer[run->next];
 }
 
-static void store_chunk(struct analyze_ctx *analyze,
-			const struct scan_chunk_data *chunk_data) {
+/* Count the distinct chunks in the table and its runs, and their bytes */
+static void table_count(struct chunk_table *table, const char *tmpdir,
+			uint64_t *unique_chunks, uint64_t *unique_bytes) {
+    struct table_entry *entry, *best;
+    uint64_t last = 0;
+    size_t i;
+    int r, best_run;
+
+    *unique_chunks = *unique_bytes = 0;
+    if (!table->nruns) {
+	for (i=0; i<table->capacity; i++) {
+	    if (table->slots[i].fingerprint) {
+		++*unique_chunks;
+		*unique_bytes += table->slots[i].length;
+	    }
+	}
+	return;
+    }
+
+    /* A chunk may be in several runs, so merge them in order */
+    table_spill(table, tmpdir);
+    free(table->slots);
+    table->slots = 0;
+    for (r=0; r<table->nruns; r++) {
+	table->runs[r].buffer = xmalloc(RUN_BUFFER_ENTRIES *
+					sizeof(struct table_entry));
+	table->runs[r].buffered = table->runs[r].next = 0;
+    }
+    while (1) {
+	best = 0;
+	best_run = -1;
+	for (r=0; r<table->nruns; r++) {
+	    entry = run_peek(&table->runs[r], table->spill_fd);
+	    if (entry && (!best || entry->fingerprint < best->fingerprint)) {
+		best = entry;
+		best_run = r;
+	    }
+	}
+	if (!best)
+	    break;
+	if (best->fingerprint != last) {
+	    ++*unique_chunks;
+	    *unique_bytes += best->length;
+	    last = best->fingerprint;
+	}
+	table->runs[best_run].next++;
+    }
+    for (r=0; r<table->nruns; r++)
+	free(table->runs[r].buffer);
+}
+
+static void add_chunk(struct config *config, const unsigned char *data,
+		      uint64_t base, uint64_t end) {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    uint64_t fingerprint, length;
     int i;
-    sha256_ctx sha256;
-    unsigned char sha256_digest[32];
-    char sha256_digest_string[65];
-    int chunk_size = 0;
-
-    sha256_init(&sha256);
-    for (i=0; i<2; i++) {
-	chunk_size +=  chunk_data[i].size;
-	if (chunk_data[i].buf && chunk_data[i].size)
-	    sha256_update(&sha256, chunk_data[i].buf, chunk_data[i].size);
-    }
-    sha256_final(&sha256, sha256_digest);
-    sprintf(sha256_digest_string, "%016" PRIx64
-	                          "%016" PRIx64
-	                          "%016" PRIx64
-	                          "%016" PRIx64,
-	    bswap_64(*(uint64_t *)&sha256_digest[0]),
-	    bswap_64(*(uint64_t *)&sha256_digest[8]),
-	    bswap_64(*(uint64_t *)&sha256_digest[16]),
-	    bswap_64(*(uint64_t *)&sha256_digest[24]));
-    if (sqlite3_bind_text(analyze->db_insert_stmt, 1, sha256_digest_string, -1,
-		SQLITE_STATIC) != SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
-    }
-    if (sqlite3_bind_int64(analyze->db_insert_stmt, 3, analyze->offset) !=
-	    SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
-    }
-    if (sqlite3_bind_int(analyze->db_insert_stmt, 4, chunk_size) != SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
-    }
-    if (sqlite3_step(analyze->db_insert_stmt) != SQLITE_DONE) {
-	print_sqlite3_error(analyze->db);
-	abort();
-    }
-    if (sqlite3_reset(analyze->db_insert_stmt) != SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
-    }
-#if 0
-    printf("%016lx%016lx%016lx%016lx %d\n",
-	    bswap64(*(uint64_t *)&sha256_digest[0]),
-	    bswap64(*(uint64_t *)&sha256_digest[8]),
-	    bswap64(*(uint64_t *)&sha256_digest[16]),
-	    bswap64(*(uint64_t *)&sha256_digest[24]),
-	    chunk_size);
-#endif
 
-    analyze->offset += chunk_size;
+    if (end > config->hashed)
+	sha256_update(&config->sha256, data + (config->hashed - base),
+		      end - config->hashed);
+    sha256_final(&config->sha256, digest);
+    length = end - config->chunk_start;
+
+    if (config->analyze->list) {
+	for (i=0; i<SHA256_DIGEST_SIZE; i++)
+	    printf("%02x", digest[i]);
+	printf(",%llu,%llu\n", (unsigned long long)config->chunk_start,
+	       (unsigned long long)length);
+    }
+
+    memcpy(&fingerprint, digest, sizeof(fingerprint));
+    if (!fingerprint)
+	fingerprint = 1;
+    table_insert(&config->table, fingerprint, length,
+		 config->analyze->tmpdir);
+    config->chunks++;
+    config->bytes += length;
+
+    sha256_init(&config->sha256);
+    config->chunk_start = config->hashed = end;
 }
 
-struct analyze_ctx *analyze_open(const char *db_filename, const char *tag) {
-    struct analyze_ctx *analyze;
+/* Find the chunks that end in the current block, exactly as read_chunk in
+ * scan.c does */
+static void chunk_block(struct config *config) {
+    const struct analyze_ctx *analyze = config->analyze;
+    const unsigned char *data = analyze->buffer + analyze->history;
+    const uint32_t *hashes = config->window->hashes;
+    uint64_t base = analyze->base, end = base + analyze->n;
+    uint64_t start, pos, stop, limit;
+    uint32_t mask = config->target - 1;
 
-    analyze = malloc(sizeof(struct analyze_ctx));
-    if (!analyze)
-	return 0;
+    while (1) {
+	start = config->chunk_start;
+	/* What is left at the end is the last chunk if it is no more than
+	 * the minimum */
+	if (analyze->last && end - start <= (uint64_t)config->minimum)
+	    break;
+
+	pos = start + config->minimum;
+	if (pos < base)
+	    pos = base;
+	limit = start + config->maximum;
+	/* A boundary right at the end of the block can only be taken once
+	 * it is known whether more follows */
+	stop = analyze->last ? end : end - 1;
+	if (stop > limit)
+	    stop = limit;
+	while (pos <= stop && (hashes[pos - base] & mask) != mask)
+	    pos++;
+	if (pos > stop) {
+	    if (stop < limit)
+		break;
+	    pos = limit;
+	}
+	add_chunk(config, data, base, pos);
+    }
+
+    if (end > config->hashed) {
+	sha256_update(&config->sha256, data + (config->hashed - base),
+		      end - config->hashed);
+	config->hashed = end;
+    }
+    if (analyze->last)
+	add_chunk(config, data, base, end);
+}
 
-    analyze->offset = 0;
+static void *config_main(void *arg) {
+    struct config *config = arg;
+    struct analyze_ctx *analyze = config->analyze;
+
+    while (1) {
+	pthread_barrier_wait(&analyze->start);
+	if (analyze->stop)
+	    break;
+	chunk_block(config);
+	pthread_barrier_wait(&analyze->done);
+    }
+    return NULL;
+}
+
+#define NEXT_GENERIC(hash, old, new) rabin_hash_next(window->rabin, hash, \
+						     old, new)
+#define NEXT_32(hash, old, new) rabin_hash_next_32(hash, old, new)
+#define NEXT_48(hash, old, new) rabin_hash_next_48(hash, old, new)
+#define NEXT_64(hash, old, new) rabin_hash_next_64(hash, old, new)
+
+#define ROLL_WINDOW(NEXT) \
+    for (i=0; i<n; i++) { \
+	hash = NEXT(hash, old[i], data[i]); \
+	hashes[i+1] = hash; \
+    }
+
+/* Fill in the hash of the window ending at each byte of the block. The
+ * bytes before the start of the file are taken as zeroes, whose hash is 0,
+ * so the hash is right from the first full window on. */
+static void roll_window(struct window *window, const unsigned char *data,
+			int n) {
+    const unsigned char *old = data - window->size;
+    uint32_t *hashes = window->hashes;
+    uint32_t hash = window->hash;
+    int i;
 
-    if (sqlite3_open(db_filename, &analyze->db) != SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
+    hashes[0] = hash;
+    switch (rabin_kernel(window->rabin)) {
+	case 32:
+	    ROLL_WINDOW(NEXT_32)
+	    break;
+	case 48:
+	    ROLL_WINDOW(NEXT_48)
+	    break;
+	case 64:
+	    ROLL_WINDOW(NEXT_64)
+	    break;
+	default:
+	    ROLL_WINDOW(NEXT_GENERIC)
+	    break;
     }
+    window->hash = hash;
+}
+
+static int analyze_file(struct analyze_ctx *analyze, int fd) {
+    unsigned char *data = analyze->buffer + analyze->history;
+    struct config *config;
+    int i, n, eof = 0;
 
-    if (sqlite3_exec(analyze->db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    memset(analyze->buffer, 0, analyze->history);
+    for (i=0; i<analyze->nwindows; i++)
+	analyze->windows[i].hash = 0;
+    for (i=0; i<analyze->nconfigs; i++) {
+	config = &analyze->configs[i];
+	config->chunk_start = config->hashed = 0;
+	sha256_init(&config->sha256);
     }
 
-    if (sqlite3_prepare(analyze->db, "INSERT INTO chunk (sha256, tag, offset, length) VALUES (?, ?, ?, ?)", -1, &analyze->db_insert_stmt, NULL) != SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
+    analyze->base = 0;
+    do {
+	n = read_fully(fd, data, BLOCK_SIZE, &eof);
+	if (n < 0)
+	    return 0;
+	analyze->n = n;
+	analyze->last = eof;
+	for (i=0; i<analyze->nwindows; i++)
+	    roll_window(&analyze->windows[i], data, n);
+
+	pthread_barrier_wait(&analyze->start);
+	pthread_barrier_wait(&analyze->done);
+
+	analyze->base += n;
+	memmove(analyze->buffer, analyze->buffer + n, analyze->history);
+    } while (!eof);
+    return 1;
+}
+
+/* Parse a size with an optional k, M or G suffix */
+static int parse_size(const char *s, char **end, long long *size) {
+    *size = strtoll(s, end, 10);
+    if (*end == s || *size <= 0)
+	return 0;
+    switch (**end) {
+	case 'k': case 'K':
+	    *size <<= 10;
+	    ++*end;
+	    break;
+	case 'm': case 'M':
+	    *size <<= 20;
+	    ++*end;
+	    break;
+	case 'g': case 'G':
+	    *size <<= 30;
+	    ++*end;
+	    break;
     }
+    return *size <= 1 << 30;
+}
+
+static int parse_config(struct analyze_ctx *analyze, const char *s) {
+    struct config *config;
+    long long sizes[4] = { 0, 0, 0, DEFAULT_WINDOW };
+    char *end;
+    int i;
 
-    if (sqlite3_bind_text(analyze->db_insert_stmt, 2, tag, -1,
-			  SQLITE_STATIC) != SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
+    if (analyze->nconfigs == MAX_CONFIGS) {
+	fprintf(stderr, "analyze: at most %d configurations\n", MAX_CONFIGS);
+	return 0;
+    }
+    for (i=0; i<4; i++) {
+	if (!parse_size(s, &end, &sizes[i]))
+	    break;
+	s = end;
+	if (*s != ',')
+	    break;
+	s++;
+    }
+    if (*s || i < 2) {
+	fputs("analyze: a configuration is target,minimum,maximum[,window]\n",
+	      stderr);
+	return 0;
+    }
+    if (sizes[0] & (sizes[0] - 1) || sizes[0] < 2) {
+	fputs("analyze: the target must be a power of two\n", stderr);
+	return 0;
+    }
+    if (sizes[1] >= sizes[2] || sizes[3] > sizes[1] ||
+	    sizes[3] > MAX_WINDOW) {
+	fprintf(stderr, "analyze: the window must be no more than the minimum "
+		"or %d, and the minimum less than the maximum\n", MAX_WINDOW);
+	return 0;
     }
 
-    return analyze;
+    config = &analyze->configs[analyze->nconfigs++];
+    config->analyze = analyze;
+    config->target = sizes[0];
+    config->minimum = sizes[1];
+    config->maximum = sizes[2];
+    /* Remember the window size until the windows are set up */
+    config->window = (struct window *)(intptr_t)sizes[3];
+    return 1;
 }
 
-void analyze_close(struct analyze_ctx *analyze) {
-    sqlite3_finalize(analyze->db_insert_stmt);
+/* Share a window between the configurations that have the same size */
+static void setup_windows(struct analyze_ctx *analyze) {
+    struct config *config;
+    struct window *window;
+    int i, j, size;
 
-    if (sqlite3_exec(analyze->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
-	print_sqlite3_error(analyze->db);
-	abort();
+    analyze->history = 0;
+    for (i=0; i<analyze->nconfigs; i++) {
+	config = &analyze->configs[i];
+	size = (intptr_t)config->window;
+	for (j=0; j<analyze->nwindows; j++) {
+	    if (analyze->windows[j].size == size)
+		break;
+	}
+	window = &analyze->windows[j];
+	if (j == analyze->nwindows) {
+	    analyze->nwindows++;
+	    window->size = size;
+	    window->rabin = rabin_init(RABIN_A, size);
+	    if (!window->rabin)
+		fail("rabin_init");
+	    window->hashes = xmalloc((BLOCK_SIZE + 1) * sizeof(uint32_t));
+	}
+	config->window = window;
+	if (size > analyze->history)
+	    analyze->history = size;
     }
+    analyze->buffer = xmalloc(analyze->history + BLOCK_SIZE);
+}
+
+static void usage(void) {
+    fputs("Usage: analyze [-c target,minimum,maximum[,window]]... [-m MiB] "
+	  "[-T dir]\n"
+	  "               [-l] file...\n", stderr);
+    exit(2);
 }
 
 int main(int argc, char **argv) {
-    struct scan_ctx *scan;
-    struct scan_chunk_data chunk_data[2];
     struct analyze_ctx *analyze;
-    int fd, result;
+    struct config *config;
+    uint64_t unique_chunks, unique_bytes;
+    size_t memory = (size_t)DEFAULT_MEMORY_MIB << 20;
+    int fd, i, c;
+
+    analyze = calloc(1, sizeof(struct analyze_ctx));
+    if (!analyze)
+	fail("calloc");
+    analyze->tmpdir = getenv("TMPDIR");
+    if (!analyze->tmpdir)
+	analyze->tmpdir = "/tmp";
 
-    analyze = analyze_open(argv[2], argv[1]);
-    if (!analyze) {
-	perror("analyze_init");
-	return EXIT_FAILURE;
+    while ((c = getopt(argc, argv, "c:m:T:l")) != -1) {
+	switch (c) {
+	    case 'c':
+		if (!parse_config(analyze, optarg))
+		    return 2;
+		break;
+	    case 'm':
+		if (atoll(optarg) <= 0)
+		    usage();
+		memory = (size_t)atoll(optarg) << 20;
+		break;
+	    case 'T':
+		analyze->tmpdir = optarg;
+		break;
+	    case 'l':
+		analyze->list = 1;
+		break;
+	    default:
+		usage();
+	}
+    }
+    if (optind == argc)
+	usage();
+    if (!analyze->nconfigs) {
+	config = &analyze->configs[analyze->nconfigs++];
+	config->analyze = analyze;
+	config->target = DEFAULT_TARGET;
+	config->minimum = DEFAULT_MINIMUM;
+	config->maximum = DEFAULT_MAXIMUM;
+	config->window = (struct window *)(intptr_t)DEFAULT_WINDOW;
+    }
+    if (analyze->list && analyze->nconfigs > 1) {
+	fputs("analyze: -l lists the chunks of only one configuration\n",
+	      stderr);
+	return 2;
     }
+    setup_windows(analyze);
 
-    scan = scan_init();
-    if (!scan) {
-	perror("scan_init");
-	return EXIT_FAILURE;
+    pthread_barrier_init(&analyze->start, NULL, analyze->nconfigs + 1);
+    pthread_barrier_init(&analyze->done, NULL, analyze->nconfigs + 1);
+    for (i=0; i<analyze->nconfigs; i++) {
+	config = &analyze->configs[i];
+	table_init(&config->table, memory / analyze->nconfigs);
+	if (pthread_create(&config->thread, NULL, config_main, config)) {
+	    fputs("analyze: pthread_create failed\n", stderr);
+	    return 1;
+	}
     }
 
-    fd = open(argv[1], O_RDWR);
-    if (fd < 0) {
-	perror("open");
-	return EXIT_FAILURE;
+    for (i=optind; i<argc; i++) {
+	if (!strcmp(argv[i], "-"))
+	    fd = 0;
+	else
+	    fd = open(argv[i], O_RDONLY);
+	if (fd < 0)
+	    fail(argv[i]);
+	if (!analyze_file(analyze, fd))
+	    fail(argv[i]);
+	if (fd)
+	    close(fd);
     }
-    scan_set_fd(scan, fd);
-    scan_set_aio(scan);
 
-    if (!scan_begin(scan))
-	return EXIT_FAILURE;
-    do {
-	result = scan_read_chunk(scan, chunk_data);
-	if (result & SCAN_CHUNK_FOUND)
-	    store_chunk(analyze, chunk_data);
-	else {
-	    fputs("Scan error\n", stderr);
-	    return EXIT_FAILURE;
-	}
-    } while (!(result & SCAN_CHUNK_LAST));
-    analyze_close(analyze);
-    scan_free(scan);
+    analyze->stop = 1;
+    pthread_barrier_wait(&analyze->start);
+    for (i=0; i<analyze->nconfigs; i++)
+	pthread_join(analyze->configs[i].thread, NULL);
+    if (analyze->list)
+	return EXIT_SUCCESS;
 
+    puts("target,minimum,maximum,window,bytes,chunks,unique_bytes,"
+	 "unique_chunks,dedup_ratio,mean_chunk_size,index_bytes");
+    for (i=0; i<analyze->nconfigs; i++) {
+	config = &analyze->configs[i];
+	table_count(&config->table, analyze->tmpdir, &unique_chunks,
+		    &unique_bytes);
+	printf("%d,%d,%d,%d,%llu,%llu,%llu,%llu,%.3f,%.0f,%llu\n",
+	       config->target, config->minimum, config->maximum,
+	       config->window->size, (unsigned long long)config->bytes,
+	       (unsigned long long)config->chunks,
+	       (unsigned long long)unique_bytes,
+	       (unsigned long long)unique_chunks,
+	       unique_bytes ? (double)config->bytes / unique_bytes : 1.0,
+	       config->chunks ? (double)config->bytes / config->chunks : 0.0,
+	       (unsigned long long)(config->chunks * CHUNK_ROW_BYTES +
+				    unique_chunks * OBJECT_ROW_BYTES));
+    }
     return EXIT_SUCCESS;
 }
 
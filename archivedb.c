@@ -0,0 +1,461 @@
+/*
+   Copyright 2010-2011 True Blue Logic Ltd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of version 3 of the GNU General Public License as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Storing into an archive natively, in the same way as the Archive methods
+ * in ddar so that either may be used on the same archive. This is shared by
+ * storeserver.c, which receives chunks from a remote client, and ingest.c,
+ * which reads them from a local file.
+ *
+ * Object files are written asynchronously by a pool of threads, since on a
+ * network filesystem each write, rename and so on is mostly waiting. Their
+ * rows are added to the database at once, but the transaction is only
+ * committed once every object file written is durable, so the database
+ * never refers to an object that might be lost. Making them durable is done
+ * once per commit with syncfs() where there is one, rather than once per
+ * file. */
+
+#define _GNU_SOURCE /* for syncfs */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "crc32c.h"
+#include "archivedb.h"
+
+#ifdef __linux__
+# define HAVE_SYNCFS
+#endif
+
+/* The most object data that may be waiting to be written. A larger object
+ * is still let through on its own. */
+#define WRITE_BYTES (1 << 26)
+
+struct object_write {
+    struct object_write *next;
+    unsigned char sha256[SHA256_SIZE];
+    size_t size;
+    unsigned char data[1];
+};
+
+void hexlify(const unsigned char *p, size_t size, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+
+    while (size--) {
+	*hex++ = digits[*p >> 4];
+	*hex++ = digits[*p++ & 0xf];
+    }
+    *hex = '\0';
+}
+
+int write_all(int fd, const unsigned char *p, size_t size) {
+    ssize_t result;
+
+    while (size) {
+	result = write(fd, p, size);
+	if (result < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += result;
+	size -= result;
+    }
+    return 0;
+}
+
+int archive_db_fail(struct archive_db *a, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(a->error, a->error_size, fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+static int fail_sqlite3(struct archive_db *a) {
+    return archive_db_fail(a, "sqlite3: %s", sqlite3_errmsg(a->db));
+}
+
+static int db_exec(struct archive_db *a, const char *sql) {
+    if (sqlite3_exec(a->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+	return fail_sqlite3(a);
+    return 0;
+}
+
+static int db_step_done(struct archive_db *a, sqlite3_stmt *stmt) {
+    int result = sqlite3_step(stmt);
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (result != SQLITE_DONE)
+	return fail_sqlite3(a);
+    return 0;
+}
+
+static int prepare(struct archive_db *a, const char *sql,
+		   sqlite3_stmt **stmt) {
+    if (sqlite3_prepare_v2(a->db, sql, -1, stmt, NULL) != SQLITE_OK)
+	return fail_sqlite3(a);
+    return 0;
+}
+
+/* Open the database of the archive in dirname. archive_db_close must be
+ * called afterwards even if this fails. */
+int archive_db_open(struct archive_db *a, const char *dirname,
+		    char *error, size_t error_size) {
+    char *db_name;
+    int result = -1;
+
+    memset(a, 0, sizeof(*a));
+    a->dirname = dirname;
+    a->error = error;
+    a->error_size = error_size;
+    pthread_mutex_init(&a->write_lock, NULL);
+    pthread_cond_init(&a->write_cond, NULL);
+
+    db_name = malloc(strlen(dirname) + sizeof("/db"));
+    if (!db_name)
+	return archive_db_fail(a, "out of memory");
+    sprintf(db_name, "%s/db", dirname);
+    if (sqlite3_open(db_name, &a->db) != SQLITE_OK) {
+	fail_sqlite3(a);
+	goto out;
+    }
+    sqlite3_busy_timeout(a->db, 5000); /* as python's sqlite3 module */
+    if (db_exec(a, "PRAGMA foreign_keys = ON") ||
+	    prepare(a, "SELECT 1 FROM chunk WHERE hash=? LIMIT 1",
+		    &a->have_stmt) ||
+	    prepare(a, "INSERT OR REPLACE INTO object (hash, crc32c) "
+			"VALUES (?, ?)", &a->insert_object_stmt) ||
+	    prepare(a, "INSERT INTO chunk (member_id, hash, offset, length) "
+			"VALUES (?, ?, ?, ?)", &a->insert_chunk_stmt) ||
+	    prepare(a, "UPDATE member SET hash=?, length=? WHERE id=?",
+		    &a->complete_stmt))
+	goto out;
+    result = 0;
+
+out:
+    free(db_name);
+    return result;
+}
+
+static void stop_writers(struct archive_db *a);
+
+void archive_db_close(struct archive_db *a) {
+    stop_writers(a);
+    pthread_mutex_destroy(&a->write_lock);
+    pthread_cond_destroy(&a->write_cond);
+    sqlite3_finalize(a->have_stmt);
+    sqlite3_finalize(a->insert_object_stmt);
+    sqlite3_finalize(a->insert_chunk_stmt);
+    sqlite3_finalize(a->complete_stmt);
+    sqlite3_close(a->db);
+    a->db = NULL;
+}
+
+int archive_db_begin(struct archive_db *a) {
+    if (a->in_transaction)
+	return 0;
+    if (db_exec(a, "BEGIN"))
+	return -1;
+    a->in_transaction = 1;
+    return 0;
+}
+
+/* Record the first failure of a writer thread, to be reported by whatever
+ * the caller does next */
+static void write_failed(struct archive_db *a, const char *error) {
+    pthread_mutex_lock(&a->write_lock);
+    if (!a->write_failed) {
+	a->write_failed = 1;
+	snprintf(a->write_error, sizeof(a->write_error), "%s", error);
+    }
+    pthread_mutex_unlock(&a->write_lock);
+}
+
+/* Wait for every object file queued to be written, then make them durable.
+ * Returns -1 if any of that failed, with a message in write_error. */
+static int flush_objects(struct archive_db *a) {
+    int failed;
+#ifdef HAVE_SYNCFS
+    char error[256];
+    int fd;
+#endif
+
+    pthread_mutex_lock(&a->write_lock);
+    while (a->writes_pending)
+	pthread_cond_wait(&a->write_cond, &a->write_lock);
+    failed = a->write_failed;
+    pthread_mutex_unlock(&a->write_lock);
+    if (failed)
+	return -1;
+    if (!a->unsynced)
+	return 0;
+
+#ifdef HAVE_SYNCFS
+    fd = open(a->dirname, O_RDONLY);
+    if (fd < 0 || syncfs(fd)) {
+	snprintf(error, sizeof(error), "%s: %s", a->dirname, strerror(errno));
+	write_failed(a, error);
+	if (fd >= 0)
+	    close(fd);
+	return -1;
+    }
+    close(fd);
+#endif
+    a->unsynced = 0;
+    return 0;
+}
+
+/* Commit, once the object files that the rows being committed refer to are
+ * durable. If they cannot be made so, nothing is committed. */
+int archive_db_commit(struct archive_db *a) {
+    if (!a->in_transaction)
+	return 0;
+    if (flush_objects(a)) {
+	archive_db_fail(a, "%s", a->write_error);
+	sqlite3_exec(a->db, "ROLLBACK", NULL, NULL, NULL);
+	a->in_transaction = 0;
+	return -1;
+    }
+    if (db_exec(a, "COMMIT"))
+	return -1;
+    a->in_transaction = 0;
+    return 0;
+}
+
+/* After an error, commit whatever was stored if that is consistent, so that
+ * the store may be resumed, leaving the message in error alone */
+void archive_db_salvage(struct archive_db *a) {
+    if (!a->in_transaction)
+	return;
+    sqlite3_exec(a->db, flush_objects(a) ? "ROLLBACK" : "COMMIT",
+		 NULL, NULL, NULL);
+    a->in_transaction = 0;
+}
+
+/* Returns 1 if the chunk is in the archive, 0 if not or -1 on error */
+int archive_db_have_chunk(struct archive_db *a, const unsigned char *sha256) {
+    int result;
+
+    if (sqlite3_bind_blob(a->have_stmt, 1, sha256, SHA256_SIZE,
+			  SQLITE_STATIC) != SQLITE_OK)
+	return fail_sqlite3(a);
+    result = sqlite3_step(a->have_stmt);
+    sqlite3_reset(a->have_stmt);
+    sqlite3_clear_bindings(a->have_stmt);
+    if (result == SQLITE_ROW)
+	return 1;
+    if (result == SQLITE_DONE)
+	return 0;
+    return fail_sqlite3(a);
+}
+
+/* Write an object file as Archive._write_object_file does. Returns -1 on
+ * error with a message in error. */
+static int write_object_file(struct archive_db *a, struct object_write *w,
+			     char *error, size_t error_size) {
+    char hex[SHA256_SIZE * 2 + 1];
+    size_t dirname_size = strlen(a->dirname);
+    char *object_dir, *temp_name, *object_name;
+    int fd, result = -1;
+
+    hexlify(w->sha256, SHA256_SIZE, hex);
+    object_dir = malloc(dirname_size + sizeof("/objects/xx"));
+    temp_name = malloc(dirname_size + sizeof("/objects/xx/tmpXXXXXX"));
+    object_name = malloc(dirname_size + sizeof("/objects/xx/") +
+			 SHA256_SIZE * 2);
+    if (!object_dir || !temp_name || !object_name) {
+	snprintf(error, error_size, "out of memory");
+	goto out;
+    }
+    sprintf(object_dir, "%s/objects/%.2s", a->dirname, hex);
+    sprintf(temp_name, "%s/tmpXXXXXX", object_dir);
+    sprintf(object_name, "%s/%s", object_dir, hex + 2);
+
+    if (mkdir(object_dir, 0777) && errno != EEXIST) {
+	snprintf(error, error_size, "%s: %s", object_dir, strerror(errno));
+	goto out;
+    }
+    fd = mkstemp(temp_name);
+    if (fd < 0) {
+	snprintf(error, error_size, "%s: %s", temp_name, strerror(errno));
+	goto out;
+    }
+    if (write_all(fd, w->data, w->size)
+#ifndef HAVE_SYNCFS
+	    || fsync(fd)
+#endif
+	    ) {
+	snprintf(error, error_size, "%s: %s", temp_name, strerror(errno));
+	close(fd);
+	unlink(temp_name);
+	goto out;
+    }
+    if (close(fd) || rename(temp_name, object_name)) {
+	snprintf(error, error_size, "%s: %s", object_name, strerror(errno));
+	unlink(temp_name);
+	goto out;
+    }
+    result = 0;
+
+out:
+    free(object_dir);
+    free(temp_name);
+    free(object_name);
+    return result;
+}
+
+static void *writer_main(void *arg) {
+    struct archive_db *a = arg;
+    struct object_write *w;
+    char error[256];
+    int result;
+
+    pthread_mutex_lock(&a->write_lock);
+    for (;;) {
+	while (!a->write_head && !a->write_stop)
+	    pthread_cond_wait(&a->write_cond, &a->write_lock);
+	w = a->write_head;
+	if (!w)
+	    break;
+	a->write_head = w->next;
+	if (!a->write_head)
+	    a->write_tail = NULL;
+	pthread_mutex_unlock(&a->write_lock);
+
+	result = write_object_file(a, w, error, sizeof(error));
+	if (result)
+	    write_failed(a, error);
+
+	pthread_mutex_lock(&a->write_lock);
+	a->write_bytes -= w->size;
+	a->writes_pending--;
+	free(w);
+	pthread_cond_broadcast(&a->write_cond);
+    }
+    pthread_mutex_unlock(&a->write_lock);
+    return NULL;
+}
+
+static int start_writers(struct archive_db *a) {
+    while (a->writers_running < OBJECT_WRITERS &&
+	    !pthread_create(&a->writers[a->writers_running], NULL,
+			    writer_main, a))
+	a->writers_running++;
+    if (!a->writers_running)
+	return archive_db_fail(a, "failed to start a thread");
+    return 0;
+}
+
+/* Stop the writer threads once they have written everything queued */
+static void stop_writers(struct archive_db *a) {
+    int i;
+
+    pthread_mutex_lock(&a->write_lock);
+    a->write_stop = 1;
+    pthread_cond_broadcast(&a->write_cond);
+    pthread_mutex_unlock(&a->write_lock);
+    for (i = 0; i < a->writers_running; i++)
+	pthread_join(a->writers[i], NULL);
+    a->writers_running = 0;
+}
+
+/* Queue an object file to be written and record it in the database, in the
+ * same way as Archive._store_object. data is copied, so need not be kept. A
+ * failure to write an earlier object may be reported here. */
+int archive_db_write_object(struct archive_db *a,
+			    const unsigned char *sha256,
+			    const unsigned char *data, size_t size) {
+    struct object_write *w;
+
+    if (!a->writers_running && start_writers(a))
+	return -1;
+    w = malloc(sizeof(*w) + size);
+    if (!w)
+	return archive_db_fail(a, "out of memory");
+    memcpy(w->sha256, sha256, SHA256_SIZE);
+    memcpy(w->data, data, size);
+    w->size = size;
+    w->next = NULL;
+
+    pthread_mutex_lock(&a->write_lock);
+    while (!a->write_failed && a->write_head &&
+	    a->write_bytes + size > WRITE_BYTES)
+	pthread_cond_wait(&a->write_cond, &a->write_lock);
+    if (a->write_failed) {
+	pthread_mutex_unlock(&a->write_lock);
+	free(w);
+	return archive_db_fail(a, "%s", a->write_error);
+    }
+    if (a->write_tail)
+	a->write_tail->next = w;
+    else
+	a->write_head = w;
+    a->write_tail = w;
+    a->write_bytes += size;
+    a->writes_pending++;
+    a->unsynced = 1;
+    pthread_cond_broadcast(&a->write_cond);
+    pthread_mutex_unlock(&a->write_lock);
+
+    if (sqlite3_bind_blob(a->insert_object_stmt, 1, sha256, SHA256_SIZE,
+			  SQLITE_STATIC) != SQLITE_OK ||
+	    sqlite3_bind_int64(a->insert_object_stmt, 2,
+			       crc32c(0, data, size)) != SQLITE_OK)
+	return fail_sqlite3(a);
+    return db_step_done(a, a->insert_object_stmt);
+}
+
+/* Add a chunk row, in the same way as the end of Archive._store_chunk */
+int archive_db_insert_chunk(struct archive_db *a, int64_t member_id,
+			    const unsigned char *sha256,
+			    uint64_t offset, uint64_t length) {
+    if (sqlite3_bind_int64(a->insert_chunk_stmt, 1, member_id) !=
+	    SQLITE_OK ||
+	    sqlite3_bind_blob(a->insert_chunk_stmt, 2, sha256, SHA256_SIZE,
+			      SQLITE_STATIC) != SQLITE_OK ||
+	    sqlite3_bind_int64(a->insert_chunk_stmt, 3, offset) !=
+	    SQLITE_OK ||
+	    sqlite3_bind_int64(a->insert_chunk_stmt, 4, length) !=
+	    SQLITE_OK)
+	return fail_sqlite3(a);
+    return db_step_done(a, a->insert_chunk_stmt);
+}
+
+/* Set the hash and length of a member once all of its chunks are stored.
+ * Either may be left NULL, which is what an old client asks for. */
+int archive_db_complete_member(struct archive_db *a, int64_t member_id,
+			       const unsigned char *sha256,
+			       int have_length, uint64_t length) {
+    if ((sha256 ? sqlite3_bind_blob(a->complete_stmt, 1, sha256, SHA256_SIZE,
+				    SQLITE_STATIC) :
+		  sqlite3_bind_null(a->complete_stmt, 1)) != SQLITE_OK ||
+	    (have_length ? sqlite3_bind_int64(a->complete_stmt, 2, length) :
+			   sqlite3_bind_null(a->complete_stmt, 2)) !=
+	    SQLITE_OK ||
+	    sqlite3_bind_int64(a->complete_stmt, 3, member_id) !=
+	    SQLITE_OK)
+	return fail_sqlite3(a);
+    return db_step_done(a, a->complete_stmt);
+}
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
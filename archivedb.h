@@ -0,0 +1,70 @@
+#ifndef ARCHIVEDB_H
+#define ARCHIVEDB_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sqlite3.h"
+
+#define SHA256_SIZE 32
+
+#define OBJECT_WRITERS 8
+
+struct object_write;
+
+/* The database of an archive opened for storing members, with the statements
+ * needed prepared. Errors are described in error, which is shared with the
+ * caller.
+ *
+ * Object files are written by a pool of writer threads, so that many are in
+ * flight at once. The write_ fields are protected by write_lock. */
+struct archive_db {
+    const char *dirname;
+    sqlite3 *db;
+    sqlite3_stmt *have_stmt;
+    sqlite3_stmt *insert_object_stmt;
+    sqlite3_stmt *insert_chunk_stmt;
+    sqlite3_stmt *complete_stmt;
+    int in_transaction;
+
+    pthread_mutex_t write_lock;
+    pthread_cond_t write_cond;
+    pthread_t writers[OBJECT_WRITERS];
+    int writers_running;
+    struct object_write *write_head, *write_tail;
+    size_t write_bytes; /* queued or being written */
+    int writes_pending; /* queued or being written */
+    int write_stop;
+    int write_failed;
+    char write_error[256];
+    int unsynced; /* objects have been written since the last sync */
+
+    char *error;
+    size_t error_size;
+};
+
+void hexlify(const unsigned char *p, size_t size, char *hex);
+int write_all(int fd, const unsigned char *p, size_t size);
+
+int archive_db_fail(struct archive_db *a, const char *fmt, ...);
+int archive_db_open(struct archive_db *a, const char *dirname,
+		    char *error, size_t error_size);
+void archive_db_close(struct archive_db *a);
+int archive_db_begin(struct archive_db *a);
+int archive_db_commit(struct archive_db *a);
+void archive_db_salvage(struct archive_db *a);
+int archive_db_have_chunk(struct archive_db *a, const unsigned char *sha256);
+int archive_db_write_object(struct archive_db *a,
+			    const unsigned char *sha256,
+			    const unsigned char *data, size_t size);
+int archive_db_insert_chunk(struct archive_db *a, int64_t member_id,
+			    const unsigned char *sha256,
+			    uint64_t offset, uint64_t length);
+int archive_db_complete_member(struct archive_db *a, int64_t member_id,
+			       const unsigned char *sha256,
+			       int have_length, uint64_t length);
+
+#endif
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
@@ -0,0 +1,138 @@
+/*
+   Copyright 2010-2011 True Blue Logic Ltd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of version 3 of the GNU General Public License as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* CRC-32C (Castagnoli), as used by iSCSI and ext4. This is only used as a
+ * cheap check for bit rot in the object store; SHA-256 remains the identity
+ * of an object. The instruction set versions are used where the CPU has them
+ * and the table version otherwise, and all give identical results. */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_CRC32C_SSE42
+# include <nmmintrin.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+# define HAVE_CRC32C_ARMV8
+# include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected */
+
+static uint32_t crc32c_table[256];
+/* crc32c is called without the GIL held, from several threads at once */
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, size_t);
+
+static void crc32c_init_table(void) {
+    uint32_t i, j, crc;
+
+    for (i=0; i<256; i++) {
+	crc = i;
+	for (j=0; j<8; j++)
+	    crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+	crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t size) {
+    while (size--)
+	crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p,
+			     size_t size) {
+    /* Align to 8 bytes first so that the main loop does aligned loads */
+    while (size && ((uintptr_t)p & 7)) {
+	crc = _mm_crc32_u8(crc, *p++);
+	size--;
+    }
+#ifdef __x86_64__
+    {
+	uint64_t crc64 = crc, v;
+	while (size >= 8) {
+	    memcpy(&v, p, 8);
+	    crc64 = _mm_crc32_u64(crc64, v);
+	    p += 8;
+	    size -= 8;
+	}
+	crc = crc64;
+    }
+#endif
+    while (size >= 4) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	crc = _mm_crc32_u32(crc, v);
+	p += 4;
+	size -= 4;
+    }
+    while (size--)
+	crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+#endif /* #ifdef HAVE_CRC32C_SSE42 */
+
+#ifdef HAVE_CRC32C_ARMV8
+
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p,
+			     size_t size) {
+    uint64_t v;
+
+    while (size && ((uintptr_t)p & 7)) {
+	crc = __crc32cb(crc, *p++);
+	size--;
+    }
+    while (size >= 8) {
+	memcpy(&v, p, 8);
+	crc = __crc32cd(crc, v);
+	p += 8;
+	size -= 8;
+    }
+    while (size--)
+	crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+#endif /* #ifdef HAVE_CRC32C_ARMV8 */
+
+static void crc32c_init(void) {
+    crc32c_init_table();
+    crc32c_impl = crc32c_sw;
+#if defined(HAVE_CRC32C_SSE42)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+	crc32c_impl = crc32c_sse42;
+#elif defined(HAVE_CRC32C_ARMV8)
+    crc32c_impl = crc32c_armv8;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const unsigned char *p, size_t size) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, p, size);
+}
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
@@ -0,0 +1,11 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const unsigned char *p, size_t size);
+
+#endif
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
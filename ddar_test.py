@@ -1,8 +1,9 @@
 #!/usr/bin/python
 
-import unittest
+import hashlib, os, shutil, tempfile, threading, unittest
 
 import ddar
+import synctus.dds
 
 class TestArgParser(unittest.TestCase):
     def check_result(self, cmdline, result):
@@ -50,5 +51,216 @@ class TestArgParser(unittest.TestCase):
         self.assertRaises(ddar.OptionError, ddar.parse_args, '-ct'.split())
         self.assertRaises(ddar.OptionError, ddar.parse_args, '-c -t'.split())
 
+class TestFlowWindow(unittest.TestCase):
+    def run_link(self, window, rate, rtt, duration):
+        # Acknowledge 1 MB at a time at the given rate and round trip time
+        t = 0.0
+        while t < duration:
+            window.sample(1 << 20, t, t + rtt)
+            t += float(1 << 20) / rate
+
+    def test_converges_to_bdp(self):
+        window = ddar._FlowWindow(1 << 30, minimum=1 << 20)
+        self.run_link(window, 100e6, 0.15, 30)
+        self.assertFalse(window.startup)
+        bdp = 100e6 * 0.15
+        self.assert_(1.5 * bdp < window.limit < 2.5 * bdp)
+
+    def test_clamped(self):
+        window = ddar._FlowWindow(1 << 24)
+        self.run_link(window, 100e6, 0.15, 30)
+        self.assertEqual(window.limit, 1 << 24)
+
+class TestBitmap(unittest.TestCase):
+    def test_round_trip(self):
+        for bits in [ [], [True], [False] * 8, [True, False] * 9 ]:
+            packed = ddar._pack_bitmap(bits)
+            self.assertEqual(len(packed), (len(bits) + 7) // 8)
+            self.assertEqual(ddar._unpack_bitmap(packed, len(bits)), bits)
+
+    def test_bit_order(self):
+        self.assertEqual(ddar._pack_bitmap([True, False, False, True]), '\x09')
+
+class TestPrefixRange(unittest.TestCase):
+    def test_ranges(self):
+        self.assertEqual(ddar._prefix_range(''), ('', None))
+        self.assertEqual(ddar._prefix_range('\x12'), ('\x12', '\x13'))
+        self.assertEqual(ddar._prefix_range('\x12\xff'), ('\x12\xff', '\x13'))
+        self.assertEqual(ddar._prefix_range('\xff\xff'), ('\xff\xff', None))
+
+class TestSyncMissingObjects(unittest.TestCase):
+    def setUp(self):
+        self.top = tempfile.mkdtemp()
+        self.list_limit = ddar.RECONCILE_LIST_LIMIT
+
+    def tearDown(self):
+        ddar.RECONCILE_LIST_LIMIT = self.list_limit
+        shutil.rmtree(self.top)
+
+    def archive(self, name, hashes):
+        archive = ddar.Archive(os.path.join(self.top, name), auto_create=True)
+        for h in hashes:
+            archive.db.execute('INSERT INTO object (hash, crc32c) ' +
+                               'VALUES (?, 0)', (buffer(h),))
+        archive.db.commit()
+        return archive
+
+    def test_only_ranges_that_differ_are_listed(self):
+        # Small enough a limit that every range of the first level differs
+        # and is subdivided
+        ddar.RECONCILE_LIST_LIMIT = 2
+        hashes = [ hashlib.sha256(str(i)).digest() for i in xrange(3000) ]
+        extra = [ hashlib.sha256('extra%d' % i).digest() for i in xrange(20) ]
+        source = self.archive('source', hashes)
+        dest = self.archive('dest', hashes[50:] + extra)
+
+        listed = []
+        reconcile_objects = dest._reconcile_objects
+        def counting_reconcile_objects(cursor, prefixes, theirs=None):
+            request = reconcile_objects(cursor, prefixes, theirs)
+            for count, digest, theirs in request.reply:
+                listed.extend(theirs or [])
+            return request
+        dest._reconcile_objects = counting_reconcile_objects
+
+        missing = list(source._sync_missing_objects(source.db.cursor(), dest,
+                                                    dest.db.cursor()))
+        self.assertEqual(sorted(missing), sorted(hashes[:50]))
+        # Only the extra objects and the neighbours of the missing ones
+        self.assert_(len(listed) < 100, len(listed))
+
+class TestStats(unittest.TestCase):
+    def test_add_chunk(self):
+        stats = ddar._Stats()
+        stats.add_chunk(65536, True)
+        stats.add_chunk(131071, False)
+        stats.add_chunk(131072)
+        result = stats.as_dict()
+        self.assertEqual(result['chunks'], 3)
+        self.assertEqual(result['new_bytes'], 65536)
+        self.assertEqual(result['duplicate_bytes'], 131071)
+        self.assertEqual(result['histogram'], { '65536': 2, '131072': 1 })
+
+    def test_json(self):
+        self.assertEqual(ddar._json({ 'b': [1, 2.5], 'a': 'x"' }),
+                         '{"a": "x\\"", "b": [1, 2.500000]}')
+
+class TestChunkCache(unittest.TestCase):
+    def cache(self, size, hashes, repeated):
+        return ddar._ChunkCache(size, ddar._chunk_uses(hashes, set(repeated)))
+
+    def use(self, cache, h):
+        data = cache.get(h)
+        cache.used(h)
+        if data is None:
+            cache.put(h, h * 3)
+        return data
+
+    def test_chunk_used_furthest_away_is_dropped(self):
+        cache = self.cache(6, 'abcbac', 'abc')
+        self.assertEqual([ self.use(cache, h) for h in 'abcbac' ],
+                         [ None, None, None, 'bbb', 'aaa', None ])
+
+    def test_chunk_without_another_use_is_not_kept(self):
+        cache = self.cache(100, 'abab', 'a')
+        self.use(cache, 'a')
+        self.use(cache, 'b')
+        self.assertEqual(cache.get('b'), None)
+        self.assertEqual(cache.bytes, 3)
+        self.use(cache, 'a')
+        self.assertEqual(cache.get('a'), None)
+        self.assertEqual(cache.bytes, 0)
+
+    def test_too_large_is_not_kept(self):
+        cache = self.cache(2, 'aa', 'a')
+        self.use(cache, 'a')
+        self.assertEqual(cache.get('a'), None)
+        self.assertEqual(cache.bytes, 0)
+
+    def test_stale_entries_are_dropped(self):
+        cache = self.cache(8, 'a' * 10001 + 'b', 'a')
+        for i in xrange(10000):
+            self.use(cache, 'a')
+        self.assert_(len(cache.heap) < 2000)
+        self.assertEqual(cache.get('a'), 'aaa')
+
+class TestReadChunks(unittest.TestCase):
+    def setUp(self):
+        self.archive = ddar.Archive.__new__(ddar.Archive)
+        self.archive.stats = ddar._Stats()
+        self.reads = []
+        def read_chunk(h):
+            self.reads.append(h)
+            return h * 2
+        self.archive._read_chunk = read_chunk
+        # Chunks are on disk in the reverse order of their names
+        self.archive._object_inode = lambda h: -ord(h)
+        self.window_bytes = ddar.RESTORE_WINDOW_BYTES
+
+    def tearDown(self):
+        ddar.RESTORE_WINDOW_BYTES = self.window_bytes
+
+    def read(self, hashes, cache=None):
+        chunks = [ (h, 2, n) for n, h in enumerate(hashes) ]
+        return list(self.archive._read_chunks(chunks, cache))
+
+    def test_reads_in_place_order_and_yields_in_given_order(self):
+        self.assertEqual(self.read('abca'),
+                         [ (0, 'aa', False), (1, 'bb', False),
+                           (2, 'cc', False), (3, 'aa', True) ])
+        self.assertEqual(self.reads, [ 'c', 'b', 'a' ])
+
+    def test_reads_a_window_at_a_time(self):
+        ddar.RESTORE_WINDOW_BYTES = 4
+        self.read('abcd')
+        self.assertEqual(self.reads, [ 'b', 'a', 'd', 'c' ])
+
+    def test_takes_chunks_from_cache(self):
+        cache = ddar._ChunkCache(100, ddar._chunk_uses('baba', set('ab')))
+        cache.used('b')
+        cache.put('b', 'bb')
+        self.assertEqual(self.read('ab', cache),
+                         [ (0, 'aa', False), (1, 'bb', True) ])
+        self.assertEqual(self.reads, [ 'a' ])
+        self.assertEqual(cache.get('a'), 'aa')
+        self.assertEqual(cache.get('b'), None)
+
+class TestMemberFilename(unittest.TestCase):
+    def test_filename(self):
+        self.assertEqual(ddar._member_filename('d', 'a/./b'), 'd/a/b')
+        self.assertEqual(ddar._member_filename('d', '/a'), 'd/a')
+        self.assertRaises(ddar.ConsoleError, ddar._member_filename, 'd',
+                          'a/../../b')
+        self.assertRaises(ddar.ConsoleError, ddar._member_filename, 'd', '/')
+
+class TestScanConcurrency(unittest.TestCase):
+    def test_scan_overlaps_writer(self):
+        # The scanner reads from a pipe that only a thread in this process
+        # writes to, and the input is much larger than a pipe's buffer, so
+        # this only finishes if the writer runs while the scanner waits
+        data = os.urandom(4 << 20)
+        r, w = os.pipe()
+        chunks = []
+
+        def scan():
+            f = os.fdopen(r, 'rb')
+            dds = synctus.dds.DDS()
+            dds.set_file(f)
+            dds.begin()
+            chunks.extend(dds.chunks())
+            f.close()
+
+        scanner = threading.Thread(target=scan)
+        scanner.setDaemon(True)
+        scanner.start()
+        f = os.fdopen(w, 'wb')
+        for i in xrange(0, len(data), 1 << 16):
+            f.write(data[i:i + (1 << 16)])
+            f.flush()
+        f.close()
+        scanner.join(60)
+        self.assertFalse(scanner.isAlive())
+        self.assertEqual(''.join(chunks), data)
+
 
 # vim: set ts=8 sts=4 sw=4 ai et :
@@ -0,0 +1,461 @@
+/*
+   Copyright 2010-2011 True Blue Logic Ltd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of version 3 of the GNU General Public License as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Storing a local input as a new member, equivalent to Archive._store in
+ * ddar but without running any Python per chunk. The work is split into
+ * stages, each on its own thread or threads, linked by bounded queues so
+ * that they overlap:
+ *
+ *   reader  reads the input and finds the chunk boundaries with scan.c,
+ *           which itself reads ahead on another thread
+ *   hashers take the SHA-256 of each chunk, one per CPU up to MAX_HASHERS,
+ *           each taking the next chunk not yet taken
+ *   summer  takes the SHA-256 of the whole member, putting the chunks back
+ *           in order first
+ *   store   (the calling thread) looks each chunk up in the archive, writing
+ *           its object file if it is new, and adds its row
+ *
+ * Chunks reach the store stage in order, so the archive ends up exactly as
+ * ddar itself would leave it. A chunk is passed on between stages rather
+ * than copied, and the queues are only locked once per chunk, which is cheap
+ * next to hashing one. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scan.h"
+#include "sha2.h"
+#include "archivedb.h"
+#include "probes.h"
+#include "ingest.h"
+
+/* The most chunk data that may wait between two stages. A larger chunk is
+ * still let through on its own. */
+#define QUEUE_BYTES (1 << 24)
+
+#define MAX_HASHERS 16
+
+struct chunk {
+    struct chunk *next;
+    uint64_t seq; /* the position of the chunk in the member */
+    uint64_t offset;
+    size_t size;
+    int last;
+    unsigned char sha256[SHA256_SIZE];
+    unsigned char data[1];
+};
+
+/* A queue from one or more producers to one or more consumers. An ordered
+ * queue keeps its chunks sorted by seq and only gives them out in turn, for
+ * when there are several producers finishing chunks out of order. */
+struct queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    struct chunk *head, *tail;
+    size_t bytes;
+    int ordered;
+    uint64_t next_seq; /* ordered only: the next chunk to give out */
+    int producers; /* how many have yet to finish */
+    int done;    /* the producers will put no more */
+    int aborted; /* the consumers will get no more */
+};
+
+struct ingest_ctx {
+    int fd;
+    int aio, huge_pages;
+
+    struct queue hash_queue;  /* reader to hashers */
+    struct queue sum_queue;   /* hashers to summer */
+    struct queue store_queue; /* summer to store */
+
+    sha256_ctx member_sha256; /* only touched by the summer */
+    char reader_error[256];   /* only read once the reader has finished */
+
+    /* Each stage adds its own times, the hashers atomically */
+    struct ingest_stats *stats;
+};
+
+static void queue_init(struct queue *q, int producers, int ordered) {
+    memset(q, 0, sizeof(*q));
+    q->producers = producers;
+    q->ordered = ordered;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+static void free_chunks(struct chunk *c) {
+    struct chunk *next;
+
+    for (; c; c = next) {
+	next = c->next;
+	free(c);
+    }
+}
+
+static void queue_destroy(struct queue *q) {
+    free_chunks(q->head);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+/* Whether the chunk at the front of q may be given out */
+static int queue_ready(struct queue *q) {
+    return q->head && (!q->ordered || q->head->seq == q->next_seq);
+}
+
+/* Add c to q, waiting for room. The next chunk due out of an ordered queue
+ * never waits, since the consumer may be waiting for it to make room.
+ * Returns -1, freeing c, if the consumers have given up. */
+static int queue_put(struct queue *q, struct chunk *c) {
+    struct chunk **p;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->aborted && q->head && q->bytes + c->size > QUEUE_BYTES &&
+	    !(q->ordered && c->seq == q->next_seq))
+	pthread_cond_wait(&q->not_full, &q->lock);
+    if (q->aborted) {
+	pthread_mutex_unlock(&q->lock);
+	free(c);
+	return -1;
+    }
+    if (q->ordered) {
+	for (p = &q->head; *p && (*p)->seq < c->seq; p = &(*p)->next)
+	    ;
+	c->next = *p;
+	*p = c;
+	if (!c->next)
+	    q->tail = c;
+    } else {
+	c->next = NULL;
+	if (q->tail)
+	    q->tail->next = c;
+	else
+	    q->head = c;
+	q->tail = c;
+    }
+    q->bytes += c->size;
+    if (queue_ready(q))
+	pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* Take the next chunk from q, waiting for one. Returns NULL once the
+ * producers are done and q is empty. */
+static struct chunk *queue_get(struct queue *q) {
+    struct chunk *c = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (!queue_ready(q) && !q->done)
+	pthread_cond_wait(&q->not_empty, &q->lock);
+    if (queue_ready(q)) {
+	c = q->head;
+	q->head = c->next;
+	if (!q->head)
+	    q->tail = NULL;
+	q->bytes -= c->size;
+	q->next_seq++;
+	pthread_cond_broadcast(&q->not_full);
+	/* Another consumer may be able to take the next one already */
+	if (queue_ready(q))
+	    pthread_cond_signal(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return c;
+}
+
+/* Called by each producer when it will put no more */
+static void queue_finish(struct queue *q) {
+    pthread_mutex_lock(&q->lock);
+    if (--q->producers <= 0) {
+	q->done = 1;
+	pthread_cond_broadcast(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Called by a consumer to stop the producers, discarding what is queued */
+static void queue_abort(struct queue *q) {
+    struct chunk *c;
+
+    pthread_mutex_lock(&q->lock);
+    q->aborted = 1;
+    c = q->head;
+    q->head = q->tail = NULL;
+    q->bytes = 0;
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    free_chunks(c);
+}
+
+static void *reader_main(void *arg) {
+    struct ingest_ctx *ctx = arg;
+    struct scan_ctx *scan;
+    struct scan_chunk_data scan_data[2];
+    struct scan_stats scan_stats;
+    struct chunk *c;
+    uint64_t seq = 0, offset = 0;
+    int result;
+
+    scan = scan_init();
+    if (!scan) {
+	strcpy(ctx->reader_error, "out of memory");
+	goto out;
+    }
+    scan_set_fd(scan, ctx->fd);
+    if (ctx->aio)
+	scan_set_aio(scan);
+    else
+	scan_set_io_thread(scan);
+    if (ctx->huge_pages)
+	scan_set_huge_pages(scan);
+    if (!scan_begin(scan)) {
+	strcpy(ctx->reader_error, "error reading input");
+	goto out;
+    }
+
+    do {
+	result = scan_read_chunk(scan, scan_data);
+	if (!(result & SCAN_CHUNK_FOUND)) {
+	    strcpy(ctx->reader_error, "error reading input");
+	    break;
+	}
+	/* The chunk only stays in the scan buffer until the next read */
+	c = malloc(sizeof(*c) + scan_data[0].size + scan_data[1].size);
+	if (!c) {
+	    strcpy(ctx->reader_error, "out of memory");
+	    break;
+	}
+	memcpy(c->data, scan_data[0].buf, scan_data[0].size);
+	memcpy(c->data + scan_data[0].size, scan_data[1].buf,
+	       scan_data[1].size);
+	c->size = scan_data[0].size + scan_data[1].size;
+	c->seq = seq++;
+	c->offset = offset;
+	c->last = !!(result & SCAN_CHUNK_LAST);
+	offset += c->size;
+	if (queue_put(&ctx->hash_queue, c))
+	    break;
+    } while (!(result & SCAN_CHUNK_LAST));
+
+out:
+    if (scan) {
+	scan_get_stats(scan, &scan_stats);
+	ctx->stats->read_ns = scan_stats.read_ns;
+	ctx->stats->scan_ns = scan_stats.scan_ns;
+	scan_free(scan);
+    }
+    queue_finish(&ctx->hash_queue);
+    return NULL;
+}
+
+static void *hasher_main(void *arg) {
+    struct ingest_ctx *ctx = arg;
+    struct chunk *c;
+    uint64_t start, elapsed, sha256_ns = 0;
+
+    while ((c = queue_get(&ctx->hash_queue))) {
+	start = scan_clock_ns();
+	sha256(c->data, c->size, c->sha256);
+	elapsed = scan_clock_ns() - start;
+	sha256_ns += elapsed;
+	PROBE3(hash_complete, c->offset, c->size, elapsed);
+	if (queue_put(&ctx->sum_queue, c)) {
+	    queue_abort(&ctx->hash_queue);
+	    break;
+	}
+    }
+    __sync_fetch_and_add(&ctx->stats->sha256_ns, sha256_ns);
+    queue_finish(&ctx->sum_queue);
+    return NULL;
+}
+
+static void *summer_main(void *arg) {
+    struct ingest_ctx *ctx = arg;
+    struct chunk *c;
+    uint64_t start;
+
+    while ((c = queue_get(&ctx->sum_queue))) {
+	start = scan_clock_ns();
+	sha256_update(&ctx->member_sha256, c->data, c->size);
+	ctx->stats->member_sha256_ns += scan_clock_ns() - start;
+	if (queue_put(&ctx->store_queue, c)) {
+	    queue_abort(&ctx->sum_queue);
+	    break;
+	}
+    }
+    queue_finish(&ctx->store_queue);
+    return NULL;
+}
+
+static int hasher_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+	return 1;
+    return n > MAX_HASHERS ? MAX_HASHERS : n;
+}
+
+static void count_chunk(struct ingest_stats *stats, size_t size, int have) {
+    int bucket = 0;
+
+    while (bucket < INGEST_HISTOGRAM_BUCKETS - 1 && size >> (bucket + 1))
+	bucket++;
+    stats->histogram[bucket]++;
+    stats->chunks++;
+    /* Read by the progress reporter while the store runs */
+    if (have)
+	__atomic_fetch_add(&stats->duplicate_bytes, size, __ATOMIC_RELAXED);
+    else {
+	stats->new_chunks++;
+	__atomic_fetch_add(&stats->new_bytes, size, __ATOMIC_RELAXED);
+    }
+}
+
+/* Store each chunk coming out of the summer, as Archive._store_chunk does.
+ * Returns 1 once the last chunk is stored, 0 if the input ended early or -1
+ * on error. */
+static int store_chunks(struct ingest_ctx *ctx, struct archive_db *a,
+			int64_t member_id, uint64_t *length) {
+    struct ingest_stats *stats = ctx->stats;
+    struct chunk *c;
+    int have, last = 0;
+    uint64_t t0, t1, t2;
+
+    while ((c = queue_get(&ctx->store_queue))) {
+	t0 = scan_clock_ns();
+	have = archive_db_have_chunk(a, c->sha256);
+	t1 = scan_clock_ns();
+	stats->have_chunk_ns += t1 - t0;
+	if (have < 0 ||
+		(!have && archive_db_write_object(a, c->sha256, c->data,
+						  c->size))) {
+	    free(c);
+	    return -1;
+	}
+	t2 = scan_clock_ns();
+	stats->object_write_ns += t2 - t1;
+	if (archive_db_insert_chunk(a, member_id, c->sha256, c->offset,
+				    c->size)) {
+	    free(c);
+	    return -1;
+	}
+	stats->chunk_insert_ns += scan_clock_ns() - t2;
+	count_chunk(stats, c->size, have);
+	PROBE3(chunk_stored, c->offset, c->size, !have);
+	*length = c->offset + c->size;
+	last = c->last;
+	free(c);
+    }
+    return last;
+}
+
+/* Store the input on fd as the member with id member_id, which must already
+ * have been added to the archive in dirname with no chunks, and set its hash
+ * and length. aio and huge_pages are passed on to scan.c. On error, returns
+ * -1 with a message in error. Whatever was stored is committed either way,
+ * as with store_server(), unless an object file failed to be written. stats
+ * is filled in in both cases. */
+int ingest_store(int fd, const char *dirname, int64_t member_id,
+		 int aio, int huge_pages, struct ingest_stats *stats,
+		 char *error, size_t error_size) {
+    struct ingest_ctx ctx;
+    struct archive_db a;
+    pthread_t reader, summer, hashers[MAX_HASHERS];
+    int have_reader = 0, have_summer = 0, nhashers = 0, i, n;
+    unsigned char member_sha256[SHA256_SIZE];
+    uint64_t length = 0, start;
+    int result = -1;
+
+    n = hasher_count();
+    memset(&ctx, 0, sizeof(ctx));
+    memset(stats, 0, sizeof(*stats));
+    ctx.stats = stats;
+    ctx.fd = fd;
+    ctx.aio = aio;
+    ctx.huge_pages = huge_pages;
+    queue_init(&ctx.hash_queue, 1, 0);
+    queue_init(&ctx.sum_queue, n, 1);
+    queue_init(&ctx.store_queue, 1, 0);
+    sha256_init(&ctx.member_sha256);
+
+    if (archive_db_open(&a, dirname, error, error_size) ||
+	    archive_db_begin(&a))
+	goto out;
+
+    /* Each stage is started before the one feeding it, so that a stage
+     * that fails to start only leaves the ones after it to stop */
+    if (pthread_create(&summer, NULL, summer_main, &ctx)) {
+	archive_db_fail(&a, "failed to start a thread");
+	goto out;
+    }
+    have_summer = 1;
+    for (; nhashers < n; nhashers++)
+	if (pthread_create(&hashers[nhashers], NULL, hasher_main, &ctx))
+	    break;
+    for (i = nhashers; i < n; i++)
+	queue_finish(&ctx.sum_queue);
+    if (!nhashers) {
+	archive_db_fail(&a, "failed to start a thread");
+	goto out;
+    }
+    if (pthread_create(&reader, NULL, reader_main, &ctx)) {
+	archive_db_fail(&a, "failed to start a thread");
+	queue_finish(&ctx.hash_queue);
+	goto out;
+    }
+    have_reader = 1;
+
+    result = store_chunks(&ctx, &a, member_id, &length);
+
+out:
+    /* Stop any stages still running before looking at what they left */
+    queue_abort(&ctx.store_queue);
+    if (have_summer)
+	pthread_join(summer, NULL);
+    for (i = 0; i < nhashers; i++)
+	pthread_join(hashers[i], NULL);
+    if (have_reader)
+	pthread_join(reader, NULL);
+
+    if (result == 0) {
+	archive_db_fail(&a, "%s", ctx.reader_error[0] ? ctx.reader_error :
+			"input ended unexpectedly");
+	result = -1;
+    } else if (result == 1) {
+	sha256_final(&ctx.member_sha256, member_sha256);
+	result = archive_db_complete_member(&a, member_id, member_sha256,
+					    1, length);
+    }
+    start = scan_clock_ns();
+    if (result)
+	archive_db_salvage(&a);
+    else
+	result = archive_db_commit(&a);
+    stats->commit_ns = scan_clock_ns() - start;
+
+    archive_db_close(&a);
+    queue_destroy(&ctx.hash_queue);
+    queue_destroy(&ctx.sum_queue);
+    queue_destroy(&ctx.store_queue);
+    return result;
+}
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
@@ -0,0 +1,37 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Chunks are counted by floor(log2(size)), up to the 16 MiB maximum */
+#define INGEST_HISTOGRAM_BUCKETS 25
+
+/* Where the time went in ingest_store, and what was stored. sha256_ns is
+ * summed over all the hashers. new_bytes and duplicate_bytes are updated
+ * atomically as each chunk is stored, so they may be read with
+ * __atomic_load_n while ingest_store runs to see how far it has got. */
+struct ingest_stats {
+    uint64_t read_ns;
+    uint64_t scan_ns;
+    uint64_t sha256_ns;
+    uint64_t member_sha256_ns;
+    uint64_t have_chunk_ns;
+    uint64_t object_write_ns;
+    uint64_t chunk_insert_ns;
+    uint64_t commit_ns;
+
+    uint64_t chunks;
+    uint64_t new_chunks;
+    uint64_t new_bytes;
+    uint64_t duplicate_bytes;
+    uint64_t histogram[INGEST_HISTOGRAM_BUCKETS];
+};
+
+int ingest_store(int fd, const char *dirname, int64_t member_id,
+		 int aio, int huge_pages, struct ingest_stats *stats,
+		 char *error, size_t error_size);
+
+#endif
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
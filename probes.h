@@ -0,0 +1,30 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* Static tracepoints (USDT probes) for perf and bpftrace, under the provider
+ * name ddar. Each is a single nop where sys/sdt.h is available, and is
+ * compiled out altogether otherwise, or if NO_PROBES is defined. The probes
+ * and their arguments are listed in contrib/bpftrace/README. */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define HAVE_PROBES
+# endif
+#endif
+
+#ifdef HAVE_PROBES
+# define PROBE(name) DTRACE_PROBE(ddar, name)
+# define PROBE1(name, a) DTRACE_PROBE1(ddar, name, a)
+# define PROBE2(name, a, b) DTRACE_PROBE2(ddar, name, a, b)
+# define PROBE3(name, a, b, c) DTRACE_PROBE3(ddar, name, a, b, c)
+#else
+# define PROBE(name) do { } while (0)
+# define PROBE1(name, a) do { } while (0)
+# define PROBE2(name, a, b) do { } while (0)
+# define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
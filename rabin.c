@@ -19,6 +19,8 @@
 struct rabin_ctx {
     uint32_t *a_exp;
     int k;
+    uint32_t a;
+    uint32_t out[256]; /* the weight of each byte value leaving the window */
 };
 
 struct rabin_ctx *rabin_init(uint32_t a, int k) {
@@ -44,11 +46,29 @@ struct rabin_ctx *rabin_init(uint32_t a, int k) {
     }
 
     ctx->k = k;
+    ctx->a = a;
     ctx->a_exp = a_exp;
+    for (i=0; i<256; i++)
+	ctx->out[i] = a_exp[k-1] * i;
 
     return ctx;
 }
 
+/* Returns the window size if one of the kernels in rabin.h may be used in
+ * place of rabin_hash_next for ctx, or 0 if not */
+int rabin_kernel(const struct rabin_ctx *ctx) {
+    if (ctx->a != RABIN_A)
+	return 0;
+    switch (ctx->k) {
+	case 32:
+	case 48:
+	case 64:
+	    return ctx->k;
+	default:
+	    return 0;
+    }
+}
+
 void rabin_free(struct rabin_ctx *ctx) {
     free(ctx->a_exp);
     free(ctx);
@@ -77,8 +97,8 @@ uint32_t rabin_hash_split(const struct rabin_ctx *ctx, const unsigned char *p,
 
 uint32_t rabin_hash_next(const struct rabin_ctx *ctx, uint32_t hash, unsigned
 	char old, unsigned char new) {
-    hash -= ctx->a_exp[ctx->k-1] * old;
-    hash *= ctx->a_exp[1];
+    hash -= ctx->out[old];
+    hash *= ctx->a;
     hash += new;
     return hash;
 }
@@ -9,12 +9,31 @@ struct rabin_ctx;
 
 struct rabin_ctx *rabin_init(uint32_t a, int k);
 void rabin_free(struct rabin_ctx *ctx);
+int rabin_kernel(const struct rabin_ctx *ctx);
 uint32_t rabin_hash(const struct rabin_ctx *ctx, const unsigned char *p);
 uint32_t rabin_hash_next(const struct rabin_ctx *ctx, uint32_t hash, unsigned char old,
 	unsigned char new);
 uint32_t rabin_hash_split(const struct rabin_ctx *ctx, const unsigned char *p,
 	int size, const unsigned char *p2);
 
+/* The multiplier that ddar uses, for which the kernels below are
+ * specialised */
+#define RABIN_A 1103515245u
+
+/* Kernels rolling the hash of a window of k bytes on by one byte, with the
+ * constants folded in, as rabin_hash_next does for a ctx from
+ * rabin_init(RABIN_A, k). a_exp is RABIN_A to the power k-1. There is one
+ * for each window size that rabin_kernel() returns. */
+#define RABIN_KERNEL(k, a_exp) \
+static inline uint32_t rabin_hash_next_##k(uint32_t hash, unsigned char old, \
+					    unsigned char new) { \
+    return (hash - (a_exp) * old) * RABIN_A + new; \
+}
+
+RABIN_KERNEL(32, 0xf53981e5u)
+RABIN_KERNEL(48, 0x4e544525u)
+RABIN_KERNEL(64, 0xbe465865u)
+
 #endif
 
 /* vim: set ts=8 sts=4 sw=4 cindent : */
@@ -15,6 +15,7 @@
 */
 
 #define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS and huge pages */
 #define _FILE_OFFSET_BITS 64
 #include <stdlib.h>
 #include <stdio.h>
@@ -31,8 +32,11 @@
 #endif
 #include <string.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "rabin.h"
+#include "probes.h"
 
 #include "scan.h"
 
@@ -43,11 +47,20 @@
 # define HAVE_POSIX_FADVISE
 #endif
 
+/* The read buffer is a ring of three parts, each big enough for the largest
+ * chunk. A small regular file only needs a part big enough to read it all at
+ * once, rounded up to SMALL_BUFFER_ALIGN. */
+#define FULL_BUFFER_SIZE (3 * (1<<24))
+#define SMALL_BUFFER_ALIGN (1<<16)
+
 struct scan_ctx {
     /* The main read buffer itself */
     unsigned char *buffer[3];
     unsigned char *buffer_end;
     int buffer_size;
+    size_t buffer_capacity; /* how much is allocated at buffer[0] */
+    int buffer_mapped; /* if buffer[0] is from mmap rather than malloc */
+    int huge_pages; /* if a full size buffer should use huge pages */
 
     /* Reading the source file */
     int fd;
@@ -65,6 +78,11 @@ struct scan_ctx {
     int minimum_chunk_size;
     int maximum_chunk_size;
 
+    /* Rolls the hash over a span, specialised for the window size if
+     * possible */
+    int (*roll)(const struct rabin_ctx *, uint32_t *, const unsigned char *,
+		const unsigned char *, int, uint32_t);
+
 #ifdef HAVE_AIO
     struct aiocb aiocb;
 #endif
@@ -73,11 +91,29 @@ struct scan_ctx {
     void (*start_io)(struct scan_ctx *, unsigned char *);
     void (*finish_io)(struct scan_ctx *);
 
+    /* Reading on a thread of our own, which unlike aio works on a pipe. The
+     * io_ fields below are protected by io_lock. */
+    pthread_t io_thread;
+    pthread_mutex_t io_lock;
+    pthread_cond_t io_cond;
+    int io_thread_running;
+    int io_requested; /* a read into io_destination is wanted */
+    int io_done; /* and has finished, with these results: */
+    int io_bytes_read;
+    int io_eof;
+    int io_failed;
+    int io_stop; /* the thread should exit */
+
+    /* Kept with two clock reads per chunk and per read, so always */
+    struct scan_stats stats;
+    unsigned long long chunk_offset; /* of the next chunk to be found */
+
     jmp_buf jmp_env;
 };
 
-static int retry_read(struct scan_ctx *scan, unsigned char *p,
-		      int bytes_to_read) {
+/* Read until bytes_to_read bytes have been read or EOF, setting *eof in
+ * that case. Returns the number of bytes read or -1 on error. */
+static int read_fully(int fd, unsigned char *p, int bytes_to_read, int *eof) {
     ssize_t result;
     unsigned char *start, *end;
 
@@ -85,12 +121,12 @@ static int retry_read(struct scan_ctx *scan, unsigned char *p,
     end = p + bytes_to_read;
     while (p < end) {
 	do {
-	    result = read(scan->fd, p, end - p);
+	    result = read(fd, p, end - p);
 	} while (result < 0 && errno == EINTR);
 	if (result < 0) {
-	    longjmp(scan->jmp_env, 1);
+	    return -1;
 	} else if (!result) {
-	    scan->eof = 1;
+	    *eof = 1;
 	    break;
 	}
 	p += result;
@@ -98,6 +134,16 @@ static int retry_read(struct scan_ctx *scan, unsigned char *p,
     return p - start;
 }
 
+static int retry_read(struct scan_ctx *scan, unsigned char *p,
+		      int bytes_to_read) {
+    int result;
+
+    result = read_fully(scan->fd, p, bytes_to_read, &scan->eof);
+    if (result < 0)
+	longjmp(scan->jmp_env, 1);
+    return result;
+}
+
 static void start_sync_io(struct scan_ctx *scan, unsigned char *buffer) {
     scan->io_destination = buffer;
 }
@@ -173,6 +219,106 @@ static void finish_aio(struct scan_ctx *scan) {
 
 #endif /* #ifdef HAVE_AIO */
 
+static void *io_thread_main(void *arg) {
+    struct scan_ctx *scan = arg;
+    int bytes_read, eof;
+
+    pthread_mutex_lock(&scan->io_lock);
+    for (;;) {
+	while (!scan->io_requested && !scan->io_stop)
+	    pthread_cond_wait(&scan->io_cond, &scan->io_lock);
+	if (scan->io_stop)
+	    break;
+	scan->io_requested = 0;
+	pthread_mutex_unlock(&scan->io_lock);
+
+	eof = 0;
+	bytes_read = read_fully(scan->fd, scan->io_destination,
+				scan->buffer_size / 3, &eof);
+
+	pthread_mutex_lock(&scan->io_lock);
+	scan->io_bytes_read = bytes_read;
+	scan->io_eof = eof;
+	scan->io_failed = bytes_read < 0;
+	scan->io_done = 1;
+	pthread_cond_broadcast(&scan->io_cond);
+    }
+    pthread_mutex_unlock(&scan->io_lock);
+    return NULL;
+}
+
+static void stop_io_thread(struct scan_ctx *scan) {
+    if (!scan->io_thread_running)
+	return;
+    pthread_mutex_lock(&scan->io_lock);
+    scan->io_stop = 1;
+    pthread_cond_broadcast(&scan->io_cond);
+    pthread_mutex_unlock(&scan->io_lock);
+    pthread_join(scan->io_thread, NULL);
+    scan->io_thread_running = 0;
+}
+
+static void start_thread_io(struct scan_ctx *scan, unsigned char *buffer) {
+    if (!scan->io_thread_running) {
+	scan->io_stop = 0;
+	if (pthread_create(&scan->io_thread, NULL, io_thread_main, scan))
+	    longjmp(scan->jmp_env, 1);
+	scan->io_thread_running = 1;
+    }
+    pthread_mutex_lock(&scan->io_lock);
+    scan->io_destination = buffer;
+    scan->io_done = 0;
+    scan->io_requested = 1;
+    pthread_cond_broadcast(&scan->io_cond);
+    pthread_mutex_unlock(&scan->io_lock);
+}
+
+static void finish_thread_io(struct scan_ctx *scan) {
+    int bytes_read;
+
+    pthread_mutex_lock(&scan->io_lock);
+    while (!scan->io_done)
+	pthread_cond_wait(&scan->io_cond, &scan->io_lock);
+    bytes_read = scan->io_bytes_read;
+    if (scan->io_eof)
+	scan->eof = 1;
+    pthread_mutex_unlock(&scan->io_lock);
+    if (scan->io_failed)
+	longjmp(scan->jmp_env, 1);
+
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(scan->fd, scan->source_offset, bytes_read, POSIX_FADV_DONTNEED);
+#endif
+    scan->source_offset += bytes_read;
+    scan->bytes_left += bytes_read;
+}
+
+/* The monotonic clock that the stats are kept with */
+uint64_t scan_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void start_io(struct scan_ctx *scan, unsigned char *buffer) {
+    PROBE2(io_submit, scan->source_offset, scan->buffer_size / 3);
+    scan->start_io(scan, buffer);
+}
+
+/* Wait for the read in progress to finish, counting the time taken */
+static void wait_for_io(struct scan_ctx *scan) {
+    unsigned long long offset = scan->source_offset;
+    uint64_t start = scan_clock_ns(), wait_ns;
+
+    scan->finish_io(scan);
+    wait_ns = scan_clock_ns() - start;
+    scan->stats.read_ns += wait_ns;
+    scan->stats.bytes_read += scan->source_offset - offset;
+    scan->stats.reads++;
+    PROBE3(io_complete, offset, scan->source_offset - offset, wait_ns);
+}
+
 static inline void read_more_data(struct scan_ctx *scan) {
     unsigned char *head = scan->p + scan->bytes_left;
     unsigned char *readahead_buffer;
@@ -194,10 +340,10 @@ static inline void read_more_data(struct scan_ctx *scan) {
     else if (head == scan->buffer[2])
 	readahead_buffer = scan->buffer[0];
 
-    scan->finish_io(scan);
+    wait_for_io(scan);
 
     if (!scan->eof)
-	scan->start_io(scan, readahead_buffer);
+	start_io(scan, readahead_buffer);
 }
 
 static inline void boundary_hit(struct scan_ctx *scan, unsigned char *boundary,
@@ -217,11 +363,71 @@ static inline void boundary_hit(struct scan_ctx *scan, unsigned char *boundary,
     }
 }
 
-int scan_read_chunk(struct scan_ctx *scan,
-		    struct scan_chunk_data *chunk_data) {
-    uint32_t hash;
+/* Roll *hash on over the n bytes at p, with the bytes leaving the window at
+ * old, stopping early after the first one that gives a hash matching mask.
+ * Returns the number of bytes rolled over. Neither span may wrap, so the
+ * loop only needs to test the hash. NEXT(hash, old, new) rolls the hash on
+ * by one byte.
+ *
+ * Boundaries are rare, so the bytes are taken in groups of ROLL_GROUP with
+ * the tests of the whole group gathered into a bitmap without branching,
+ * and only one branch per group on the bitmap. */
+#define ROLL_GROUP 8
+
+#define ROLL_STEP(NEXT, j) \
+	hash = NEXT(hash, old[i+j], p[i+j]); \
+	hashes[j] = hash; \
+	hits |= (unsigned)((hash & mask) == mask) << j;
+
+#define DEFINE_ROLL(name, NEXT) \
+static int name(const struct rabin_ctx *ctx, uint32_t *hash_p, \
+		const unsigned char *old, const unsigned char *p, int n, \
+		uint32_t mask) { \
+    uint32_t hash = *hash_p, hashes[ROLL_GROUP]; \
+    unsigned hits; \
+    int i = 0; \
+\
+    for (; i + ROLL_GROUP <= n; i += ROLL_GROUP) { \
+	hits = 0; \
+	ROLL_STEP(NEXT, 0) \
+	ROLL_STEP(NEXT, 1) \
+	ROLL_STEP(NEXT, 2) \
+	ROLL_STEP(NEXT, 3) \
+	ROLL_STEP(NEXT, 4) \
+	ROLL_STEP(NEXT, 5) \
+	ROLL_STEP(NEXT, 6) \
+	ROLL_STEP(NEXT, 7) \
+	if (unlikely(hits)) { \
+	    /* Stop at the first boundary in the group */ \
+	    *hash_p = hashes[__builtin_ctz(hits)]; \
+	    return i + __builtin_ctz(hits) + 1; \
+	} \
+    } \
+    while (i < n) { \
+	hash = NEXT(hash, old[i], p[i]); \
+	i++; \
+	if (unlikely((hash & mask) == mask)) \
+	    break; \
+    } \
+    *hash_p = hash; \
+    return i; \
+}
+
+#define NEXT_GENERIC(hash, old, new) rabin_hash_next(ctx, hash, old, new)
+#define NEXT_32(hash, old, new) rabin_hash_next_32(hash, old, new)
+#define NEXT_48(hash, old, new) rabin_hash_next_48(hash, old, new)
+#define NEXT_64(hash, old, new) rabin_hash_next_64(hash, old, new)
+
+DEFINE_ROLL(roll_generic, NEXT_GENERIC)
+DEFINE_ROLL(roll_32, NEXT_32)
+DEFINE_ROLL(roll_48, NEXT_48)
+DEFINE_ROLL(roll_64, NEXT_64)
+
+static int read_chunk(struct scan_ctx *scan,
+		      struct scan_chunk_data *chunk_data) {
+    uint32_t hash, mask;
     int current_chunk_size;
-    int temp;
+    int temp, span;
     unsigned char *old;
 
     if (setjmp(scan->jmp_env))
@@ -248,8 +454,10 @@ int scan_read_chunk(struct scan_ctx *scan,
     /* Move forward by the minimum_chunk_size */
     scan->p += scan->minimum_chunk_size;
     scan->bytes_left -= scan->minimum_chunk_size;
-    if (unlikely(scan->p >= scan->buffer_end))
+    if (unlikely(scan->p >= scan->buffer_end)) {
 	scan->p -= scan->buffer_size;
+	PROBE1(buffer_wrap, scan->source_offset);
+    }
     current_chunk_size = scan->minimum_chunk_size;
 
     /* Calculate the first hash (aligned to the end of the minimum chunk size)
@@ -266,91 +474,230 @@ int scan_read_chunk(struct scan_ctx *scan,
 	hash = rabin_hash(scan->rabin_ctx, old);
     }
 
+    mask = scan->target_chunk_size - 1;
     while (1) {
-	if (unlikely((((scan->target_chunk_size-1) & hash) ==
-		    scan->target_chunk_size-1)
+	if (unlikely((hash & mask) == mask
 		|| (current_chunk_size >= scan->maximum_chunk_size))) {
 	    /* Hash has matched to a boundary, or we have got to the maximum
 	     * chunk size */
 	    boundary_hit(scan, scan->p, current_chunk_size,
 			 chunk_data);
 	    return SCAN_CHUNK_FOUND;
-	} else {
-	    /* Move up and calculate the next hash */
+	}
+	if (unlikely(!scan->bytes_left)) {
+	    if (unlikely(scan->eof)) {
+		boundary_hit(scan, scan->p, current_chunk_size,
+			     chunk_data);
+		return SCAN_CHUNK_FOUND | SCAN_CHUNK_LAST;
+	    }
+	    read_more_data(scan);
 	    if (unlikely(!scan->bytes_left)) {
-		if (unlikely(scan->eof)) {
-		    boundary_hit(scan, scan->p, current_chunk_size,
-				 chunk_data);
-		    return SCAN_CHUNK_FOUND | SCAN_CHUNK_LAST;
-		}
-		read_more_data(scan);
-		if (unlikely(!scan->bytes_left)) {
-		    assert(scan->eof);
-		    boundary_hit(scan, scan->p, current_chunk_size,
-				 chunk_data);
-		    return SCAN_CHUNK_FOUND | SCAN_CHUNK_LAST;
-		}
+		assert(scan->eof);
+		boundary_hit(scan, scan->p, current_chunk_size,
+			     chunk_data);
+		return SCAN_CHUNK_FOUND | SCAN_CHUNK_LAST;
 	    }
-	    hash = rabin_hash_next(scan->rabin_ctx, hash, *old, *scan->p);
-	    scan->p += 1;
-	    if (unlikely(scan->p >= scan->buffer_end))
-		scan->p -= scan->buffer_size;
-	    old += 1;
-	    if (unlikely(old >= scan->buffer_end))
-		old -= scan->buffer_size;
-	    scan->bytes_left -= 1;
-	    current_chunk_size += 1;
 	}
+
+	/* Roll over as much as possible before anything else needs checking:
+	 * the end of the data read, the maximum chunk size, or either
+	 * pointer wrapping */
+	span = scan->bytes_left;
+	if (span > scan->maximum_chunk_size - current_chunk_size)
+	    span = scan->maximum_chunk_size - current_chunk_size;
+	if (span > scan->buffer_end - scan->p)
+	    span = scan->buffer_end - scan->p;
+	if (span > scan->buffer_end - old)
+	    span = scan->buffer_end - old;
+	span = scan->roll(scan->rabin_ctx, &hash, old, scan->p, span, mask);
+
+	scan->p += span;
+	if (unlikely(scan->p >= scan->buffer_end)) {
+	    scan->p -= scan->buffer_size;
+	    PROBE1(buffer_wrap, scan->source_offset);
+	}
+	old += span;
+	if (unlikely(old >= scan->buffer_end))
+	    old -= scan->buffer_size;
+	scan->bytes_left -= span;
+	current_chunk_size += span;
     }
 }
 
-struct scan_ctx *scan_init(void) {
-    struct scan_ctx *scan;
+int scan_read_chunk(struct scan_ctx *scan,
+		    struct scan_chunk_data *chunk_data) {
+    uint64_t start, elapsed, read_ns;
+    int result, size;
+
+    start = scan_clock_ns();
+    read_ns = scan->stats.read_ns;
+    result = read_chunk(scan, chunk_data);
+    elapsed = scan_clock_ns() - start;
+    scan->stats.scan_ns += elapsed - (scan->stats.read_ns - read_ns);
+    if (result & SCAN_CHUNK_FOUND) {
+	size = chunk_data[0].size + chunk_data[1].size;
+	PROBE3(chunk_found, scan->chunk_offset, size, elapsed);
+	scan->chunk_offset += size;
+	scan->stats.chunks++;
+    }
+    return result;
+}
 
-    scan = malloc(sizeof(struct scan_ctx));
-    if (!scan)
-	goto unwind0;
+void scan_get_stats(struct scan_ctx *scan, struct scan_stats *stats) {
+    *stats = scan->stats;
+}
+
+static unsigned char *alloc_buffer(struct scan_ctx *scan, size_t size,
+				   int *mapped) {
+#if defined(MAP_ANONYMOUS) && (defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE))
+    /* Huge pages are only worth it for a long stream, and a full size
+     * buffer is a multiple of any huge page size */
+    if (scan->huge_pages && size == FULL_BUFFER_SIZE) {
+	void *p;
+
+#ifdef MAP_HUGETLB
+	p = mmap(0, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+	    *mapped = 1;
+	    return p;
+	}
+#endif
+#ifdef MADV_HUGEPAGE
+	/* No huge pages are reserved, so ask for transparent ones instead */
+	p = mmap(0, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED) {
+	    (void)madvise(p, size, MADV_HUGEPAGE);
+	    *mapped = 1;
+	    return p;
+	}
+#endif
+    }
+#endif
+    *mapped = 0;
+    return malloc(size);
+}
 
-    scan->buffer_size = 3 * (1<<24);
-    scan->buffer[0] = malloc(scan->buffer_size);
+static void free_buffer(struct scan_ctx *scan) {
     if (!scan->buffer[0])
-	goto unwind1;
+	return;
+    if (scan->buffer_mapped)
+	munmap(scan->buffer[0], scan->buffer_capacity);
+    else
+	free(scan->buffer[0]);
+    scan->buffer[0] = 0;
+    scan->buffer_capacity = 0;
+}
 
+static void set_buffer_size(struct scan_ctx *scan, int size) {
+    scan->buffer_size = size;
     scan->buffer[1] = scan->buffer[0] + scan->buffer_size/3;
     scan->buffer[2] = scan->buffer[1] + scan->buffer_size/3;
     scan->buffer_end = scan->buffer[0] + scan->buffer_size;
     scan->p = scan->buffer[0];
-    scan->eof = 0;
-    scan->bytes_left = 0;
-    scan->source_offset = 0;
+}
+
+/* Make the buffer size bytes, keeping the bytes_left bytes at its start,
+ * which is only called for before any have been consumed. An allocation that
+ * is big enough already is reused. */
+static int resize_buffer(struct scan_ctx *scan, int size) {
+    unsigned char *buffer;
+    int mapped;
+
+    if (scan->buffer_capacity < (size_t)size) {
+	buffer = alloc_buffer(scan, size, &mapped);
+	if (!buffer)
+	    return 0;
+	if (scan->bytes_left)
+	    memcpy(buffer, scan->buffer[0], scan->bytes_left);
+	free_buffer(scan);
+	scan->buffer[0] = buffer;
+	scan->buffer_capacity = size;
+	scan->buffer_mapped = mapped;
+    }
+    set_buffer_size(scan, size);
+    return 1;
+}
+
+struct scan_ctx *scan_init(void) {
+    struct scan_ctx *scan;
+
+    scan = malloc(sizeof(struct scan_ctx));
+    if (!scan)
+	goto unwind0;
+
+    /* The buffer is allocated by scan_begin, once the input is known */
+    scan->buffer[0] = 0;
+    scan->buffer_capacity = 0;
+    scan->buffer_mapped = 0;
+    scan->huge_pages = 0;
 
     scan->window_size = 48;
     scan->target_chunk_size = 1 << 18;
     scan->minimum_chunk_size = 1 << 16;
     scan->maximum_chunk_size = 1 << 24;
-    scan->rabin_ctx = rabin_init(1103515245, scan->window_size);
+    scan->rabin_ctx = rabin_init(RABIN_A, scan->window_size);
     if (!scan->rabin_ctx)
-	goto unwind2;
+	goto unwind1;
+    switch (rabin_kernel(scan->rabin_ctx)) {
+	case 32:
+	    scan->roll = roll_32;
+	    break;
+	case 48:
+	    scan->roll = roll_48;
+	    break;
+	case 64:
+	    scan->roll = roll_64;
+	    break;
+	default:
+	    scan->roll = roll_generic;
+	    break;
+    }
 
-    scan->start_io = start_sync_io;
-    scan->finish_io = finish_sync_io;
+    scan->io_thread_running = 0;
+    pthread_mutex_init(&scan->io_lock, NULL);
+    pthread_cond_init(&scan->io_cond, NULL);
+
+    scan_reset(scan);
 
     return scan;
 
-unwind2:
-    rabin_free(scan->rabin_ctx);
 unwind1:
-    free(scan->buffer[0]);
+    free(scan);
 unwind0:
     return 0;
 }
 
+/* Make scan ready to read another input, as if new but keeping its buffer */
+void scan_reset(struct scan_ctx *scan) {
+    stop_io_thread(scan);
+    scan->fd = -1;
+    scan->huge_pages = 0;
+    scan->p = scan->buffer[0];
+    scan->eof = 0;
+    scan->bytes_left = 0;
+    scan->source_offset = 0;
+    memset(&scan->stats, 0, sizeof(scan->stats));
+    scan->chunk_offset = 0;
+
+    scan->start_io = start_sync_io;
+    scan->finish_io = finish_sync_io;
+}
+
 void scan_free(struct scan_ctx *scan) {
+    stop_io_thread(scan);
+    pthread_mutex_destroy(&scan->io_lock);
+    pthread_cond_destroy(&scan->io_cond);
     rabin_free(scan->rabin_ctx);
-    free(scan->buffer[0]);
+    free_buffer(scan);
     free(scan);
 }
 
+void scan_set_huge_pages(struct scan_ctx *scan) {
+    scan->huge_pages = 1;
+}
+
 void scan_set_fd(struct scan_ctx *scan, int fd) {
     scan->fd = fd;
 }
@@ -368,14 +715,75 @@ void scan_set_aio(struct scan_ctx *scan) {}
 
 #endif
 
+/* Read on a thread of our own, so that reading overlaps chunking for any
+ * kind of input */
+void scan_set_io_thread(struct scan_ctx *scan) {
+    scan->start_io = start_thread_io;
+    scan->finish_io = finish_thread_io;
+}
+
+/* Read synchronously from the end of the bytes_left bytes at the start of
+ * the buffer up to the second part. The read is made at source_offset, since
+ * aio leaves the file offset where it was. */
+static void fill_first_part(struct scan_ctx *scan) {
+    unsigned char *head = scan->buffer[0] + scan->bytes_left;
+    uint64_t start = scan_clock_ns(), wait_ns;
+    int bytes_read;
+
+    if (lseek(scan->fd, scan->source_offset, SEEK_SET) < 0)
+	longjmp(scan->jmp_env, 1);
+    bytes_read = retry_read(scan, head, scan->buffer[1] - head);
+    scan->source_offset += bytes_read;
+    scan->bytes_left += bytes_read;
+
+    wait_ns = scan_clock_ns() - start;
+    scan->stats.read_ns += wait_ns;
+    scan->stats.bytes_read += bytes_read;
+    scan->stats.reads++;
+    PROBE3(io_complete, scan->source_offset - bytes_read, bytes_read,
+	   wait_ns);
+}
+
 int scan_begin(struct scan_ctx *scan) {
+    off_t offset;
+    struct stat st;
+    long long remaining;
+    int size;
+
     if (setjmp(scan->jmp_env))
 	return 0;
 
-    scan->start_io(scan, scan->buffer[0]);
-    scan->finish_io(scan);
+    /* Start from wherever the caller left the file, as aio reads at an
+       explicit offset. A pipe has no offset, and is read from as it is. */
+    offset = lseek(scan->fd, 0, SEEK_CUR);
+    scan->source_offset = offset < 0 ? 0 : offset;
+
+    size = FULL_BUFFER_SIZE;
+    if (!fstat(scan->fd, &st) && S_ISREG(st.st_mode)) {
+	remaining = st.st_size - (long long)scan->source_offset;
+	if (remaining < 0)
+	    remaining = 0;
+	/* One more byte than the file so that the first read finds EOF */
+	if (remaining < FULL_BUFFER_SIZE / 3)
+	    size = 3 * ((remaining + SMALL_BUFFER_ALIGN) &
+			~(SMALL_BUFFER_ALIGN - 1));
+    }
+    if (!resize_buffer(scan, size))
+	return 0;
+
+    start_io(scan, scan->buffer[0]);
+    wait_for_io(scan);
+    if (!scan->eof && scan->buffer_size < FULL_BUFFER_SIZE) {
+	/* The file has grown since fstat, or its size understated what it
+	 * holds, so carry on as for a stream. What has been read fills only
+	 * the start of the first part of the full size ring, which must be
+	 * filled up before reading ahead into the second. */
+	if (!resize_buffer(scan, FULL_BUFFER_SIZE))
+	    return 0;
+	fill_first_part(scan);
+    }
     if (!scan->eof)
-	scan->start_io(scan, scan->buffer[1]);
+	start_io(scan, scan->buffer[1]);
 
     return 1;
 }
@@ -1,8 +1,19 @@
 #ifndef SCAN_H
 #define SCAN_H
 
+#include <stdint.h>
+
 struct scan_ctx;
 
+/* Where the time went in a scan since scan_begin */
+struct scan_stats {
+    uint64_t read_ns; /* waiting for input */
+    uint64_t scan_ns; /* finding chunk boundaries */
+    uint64_t bytes_read;
+    uint64_t reads;
+    uint64_t chunks;
+};
+
 struct scan_chunk_data {
     unsigned char *buf;
     int size;
@@ -13,10 +24,15 @@ struct scan_chunk_data {
 
 struct scan_ctx *scan_init(void);
 void scan_free(struct scan_ctx *);
+void scan_reset(struct scan_ctx *);
 void scan_set_fd(struct scan_ctx *, int);
 void scan_set_aio(struct scan_ctx *);
+void scan_set_io_thread(struct scan_ctx *);
+void scan_set_huge_pages(struct scan_ctx *);
 int scan_begin(struct scan_ctx *);
 int scan_read_chunk(struct scan_ctx *, struct scan_chunk_data *);
+void scan_get_stats(struct scan_ctx *, struct scan_stats *);
+uint64_t scan_clock_ns(void);
 
 #endif
 
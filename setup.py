@@ -6,10 +6,10 @@ from setuptools import setup, Extension
 if sys.platform == 'linux2':
     define_macros = [ ('HAVE_AIO', None),
                     ]
-    libraries = [ 'rt' ]
+    libraries = [ 'rt', 'pthread', 'sqlite3', 'z' ]
 else:
     define_macros = []
-    libraries = []
+    libraries = [ 'pthread', 'sqlite3', 'z' ]
 
 setup(name='ddar',
       version='1.0',
@@ -18,7 +18,9 @@ setup(name='ddar',
       url='http://www.synctus.com/ddar',
       packages=['synctus'],
       scripts=['ddar'],
-      ext_modules=[ Extension('synctus._dds', ['scan.c', 'rabin.c',
+      ext_modules=[ Extension('synctus._dds', ['scan.c', 'rabin.c', 'crc32c.c',
+                                           'sha2.c', 'archivedb.c',
+                                           'storeserver.c', 'ingest.c',
                                            'synctus/ddsmodule.c'],
                               include_dirs=['.'],
                               libraries=libraries,
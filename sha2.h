@@ -56,7 +56,7 @@ extern "C" {
 #endif
 
 typedef struct {
-    unsigned int tot_len;
+    uint64 tot_len;
     unsigned int len;
     unsigned char block[2 * SHA256_BLOCK_SIZE];
     uint32 h[8];
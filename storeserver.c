@@ -0,0 +1,607 @@
+/*
+   Copyright 2010-2011 True Blue Logic Ltd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of version 3 of the GNU General Public License as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The receiving end of a remote store, equivalent to Archive._StoreRPCServer
+ * in ddar but without running any Python per chunk. ddar negotiates the
+ * protocol version and adds the member, then hands over the connection to
+ * store_server() until EOF.
+ *
+ * Only the handful of messages used by a store are understood, so the
+ * protobuf wire format is decoded and encoded by hand here rather than
+ * adding a dependency on a protobuf C library. Field numbers must be kept in
+ * step with synctus/ddar.proto. Of the wire compression codecs, only zlib
+ * is supported, so that is what SetCompressionRequest will choose. */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "sha2.h"
+#include "archivedb.h"
+#include "storeserver.h"
+
+#define MAX_REQUEST_SIZE (256 << 20)
+#define READ_SIZE 65536
+
+/* Fields of Request in ddar.proto; the corresponding Reply fields have the
+ * same numbers */
+#define REQUEST_HAVE_CHUNK 1
+#define REQUEST_STORE_CHUNK 2
+#define REQUEST_COMMIT 3
+#define REQUEST_HAVE_CHUNKS 4
+#define REQUEST_STORE_CHUNKS 5
+#define REQUEST_SET_COMPRESSION 6
+
+/* enum Compression */
+#define COMPRESSION_NONE 0
+#define COMPRESSION_ZLIB 1
+
+#define WIRE_VARINT 0
+#define WIRE_64BIT 1
+#define WIRE_BYTES 2
+#define WIRE_32BIT 5
+
+struct buf {
+    unsigned char *data;
+    size_t size, alloc;
+};
+
+struct pb_field {
+    uint32_t number;
+    int wire_type;
+    uint64_t value; /* WIRE_VARINT only */
+    const unsigned char *data; /* WIRE_BYTES only */
+    size_t size;
+};
+
+struct chunk_request {
+    const unsigned char *data;
+    size_t data_size;
+    int have_data;
+    const unsigned char *sha256;
+    uint64_t offset, length;
+    int compression;
+};
+
+struct store_server_ctx {
+    int in_fd, out_fd;
+    int64_t member_id;
+    int protocol_version;
+
+    struct archive_db db;
+
+    struct buf in;
+    size_t in_pos;
+    struct buf out;   /* encoded replies waiting to be written */
+    struct buf reply; /* the reply being built */
+    struct buf inner; /* the inner message of the reply being built */
+    struct buf data;  /* decompressed chunk data */
+
+    char *error;
+    size_t error_size;
+};
+
+static int fail(struct store_server_ctx *s, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(s->error, s->error_size, fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+static int buf_reserve(struct buf *b, size_t size) {
+    size_t alloc;
+    unsigned char *data;
+
+    if (b->size + size <= b->alloc)
+	return 0;
+    alloc = b->alloc ? b->alloc : 4096;
+    while (alloc < b->size + size)
+	alloc *= 2;
+    data = realloc(b->data, alloc);
+    if (!data)
+	return -1;
+    b->data = data;
+    b->alloc = alloc;
+    return 0;
+}
+
+static int buf_append(struct buf *b, const void *p, size_t size) {
+    if (buf_reserve(b, size))
+	return -1;
+    memcpy(b->data + b->size, p, size);
+    b->size += size;
+    return 0;
+}
+
+static int pb_put_varint(struct buf *b, uint64_t v) {
+    unsigned char tmp[10];
+    int n = 0;
+
+    do {
+	tmp[n] = v & 0x7f;
+	v >>= 7;
+	if (v)
+	    tmp[n] |= 0x80;
+	n++;
+    } while (v);
+    return buf_append(b, tmp, n);
+}
+
+static int pb_put_uint(struct buf *b, uint32_t number, uint64_t v) {
+    return pb_put_varint(b, (uint64_t)number << 3 | WIRE_VARINT) ||
+	pb_put_varint(b, v);
+}
+
+static int pb_put_bytes(struct buf *b, uint32_t number,
+			const unsigned char *p, size_t size) {
+    return pb_put_varint(b, (uint64_t)number << 3 | WIRE_BYTES) ||
+	pb_put_varint(b, size) || buf_append(b, p, size);
+}
+
+static int pb_get_varint(const unsigned char **p, const unsigned char *end,
+			 uint64_t *v) {
+    int shift = 0;
+
+    *v = 0;
+    while (*p < end && shift < 64) {
+	unsigned char c = *(*p)++;
+	*v |= (uint64_t)(c & 0x7f) << shift;
+	if (!(c & 0x80))
+	    return 0;
+	shift += 7;
+    }
+    return -1;
+}
+
+/* Read the next field of a message from *p, returning 1 if a field was
+ * read, 0 at the end of the message or -1 if the message is malformed. */
+static int pb_next_field(const unsigned char **p, const unsigned char *end,
+			 struct pb_field *f) {
+    uint64_t tag, size;
+
+    if (*p >= end)
+	return 0;
+    if (pb_get_varint(p, end, &tag))
+	return -1;
+    memset(f, 0, sizeof(*f));
+    f->number = tag >> 3;
+    f->wire_type = tag & 7;
+    switch (f->wire_type) {
+	case WIRE_VARINT:
+	    return pb_get_varint(p, end, &f->value) ? -1 : 1;
+	case WIRE_64BIT:
+	    if (end - *p < 8)
+		return -1;
+	    *p += 8;
+	    return 1;
+	case WIRE_BYTES:
+	    if (pb_get_varint(p, end, &size) || size > (uint64_t)(end - *p))
+		return -1;
+	    f->data = *p;
+	    f->size = size;
+	    *p += size;
+	    return 1;
+	case WIRE_32BIT:
+	    if (end - *p < 4)
+		return -1;
+	    *p += 4;
+	    return 1;
+	default:
+	    return -1;
+    }
+}
+
+static int bad_message(struct store_server_ctx *s) {
+    return fail(s, "malformed request");
+}
+
+static int parse_store_chunk(struct store_server_ctx *s,
+			     const unsigned char *p, size_t size,
+			     struct chunk_request *c) {
+    const unsigned char *end = p + size;
+    struct pb_field f;
+    int result;
+
+    memset(c, 0, sizeof(*c));
+    while ((result = pb_next_field(&p, end, &f)) > 0) {
+	if (f.number == 1 && f.wire_type == WIRE_BYTES) {
+	    c->data = f.data;
+	    c->data_size = f.size;
+	    c->have_data = 1;
+	} else if (f.number == 2 && f.wire_type == WIRE_BYTES) {
+	    if (f.size != SHA256_SIZE)
+		return bad_message(s);
+	    c->sha256 = f.data;
+	} else if (f.number == 3 && f.wire_type == WIRE_VARINT) {
+	    c->offset = f.value;
+	} else if (f.number == 4 && f.wire_type == WIRE_VARINT) {
+	    c->length = f.value;
+	} else if (f.number == 5 && f.wire_type == WIRE_VARINT) {
+	    c->compression = f.value;
+	}
+    }
+    if (result < 0 || !c->sha256)
+	return bad_message(s);
+    return 0;
+}
+
+static int store_chunk(struct store_server_ctx *s, struct chunk_request *c) {
+    const unsigned char *data;
+    unsigned char sha256_digest[SHA256_SIZE];
+    char hex[SHA256_SIZE * 2 + 1];
+    uLongf data_size;
+    int have;
+
+    if (archive_db_begin(&s->db))
+	return -1;
+
+    have = archive_db_have_chunk(&s->db, c->sha256);
+    if (have < 0)
+	return -1;
+    if (!have) {
+	hexlify(c->sha256, SHA256_SIZE, hex);
+	if (!c->have_data)
+	    return fail(s, "chunk %s not sent", hex);
+
+	if (c->compression == COMPRESSION_NONE) {
+	    data = c->data;
+	    data_size = c->data_size;
+	} else if (c->compression == COMPRESSION_ZLIB) {
+	    s->data.size = 0;
+	    if (c->length > MAX_REQUEST_SIZE ||
+		    buf_reserve(&s->data, c->length))
+		return fail(s, "chunk %s too large", hex);
+	    data_size = c->length;
+	    if (uncompress(s->data.data, &data_size, c->data, c->data_size) !=
+		    Z_OK)
+		return fail(s, "chunk %s failed to decompress", hex);
+	    data = s->data.data;
+	} else
+	    return fail(s, "unsupported compression %d", c->compression);
+
+	if (data_size != c->length)
+	    return fail(s, "chunk %s has the wrong length", hex);
+	sha256(data, data_size, sha256_digest);
+	if (memcmp(sha256_digest, c->sha256, SHA256_SIZE))
+	    return fail(s, "chunk %s corrupted in transit", hex);
+
+	if (archive_db_write_object(&s->db, c->sha256, data, data_size))
+	    return -1;
+    }
+
+    return archive_db_insert_chunk(&s->db, s->member_id, c->sha256,
+				   c->offset, c->length);
+}
+
+static int rpc_have_chunk(struct store_server_ctx *s,
+			  const unsigned char *p, size_t size) {
+    const unsigned char *end = p + size, *sha256 = NULL;
+    struct pb_field f;
+    int result, have;
+
+    while ((result = pb_next_field(&p, end, &f)) > 0)
+	if (f.number == 1 && f.wire_type == WIRE_BYTES &&
+		f.size == SHA256_SIZE)
+	    sha256 = f.data;
+    if (result < 0 || !sha256)
+	return bad_message(s);
+
+    have = archive_db_have_chunk(&s->db, sha256);
+    if (have < 0)
+	return -1;
+    if (pb_put_uint(&s->inner, 1, have))
+	return -1;
+    if (s->protocol_version < 2)
+	return pb_put_bytes(&s->inner, 2, sha256, SHA256_SIZE);
+    return 0;
+}
+
+static int rpc_have_chunks(struct store_server_ctx *s,
+			   const unsigned char *p, size_t size) {
+    const unsigned char *end = p + size;
+    struct pb_field f;
+    size_t count = 0;
+    int result, have;
+
+    s->data.size = 0;
+    while ((result = pb_next_field(&p, end, &f)) > 0) {
+	if (f.number != 1 || f.wire_type != WIRE_BYTES ||
+		f.size != SHA256_SIZE)
+	    continue;
+	have = archive_db_have_chunk(&s->db, f.data);
+	if (have < 0)
+	    return -1;
+	if (!(count & 7) && buf_append(&s->data, "", 1))
+	    return fail(s, "out of memory");
+	if (have)
+	    s->data.data[count >> 3] |= 1 << (count & 7);
+	count++;
+    }
+    if (result < 0)
+	return bad_message(s);
+
+    return pb_put_bytes(&s->inner, 1, s->data.data, s->data.size);
+}
+
+static int rpc_store_chunk(struct store_server_ctx *s,
+			   const unsigned char *p, size_t size) {
+    struct chunk_request c;
+
+    if (parse_store_chunk(s, p, size, &c) || store_chunk(s, &c))
+	return -1;
+    if (s->protocol_version < 2)
+	return pb_put_bytes(&s->inner, 1, c.sha256, SHA256_SIZE);
+    return 0;
+}
+
+static int rpc_store_chunks(struct store_server_ctx *s,
+			    const unsigned char *p, size_t size) {
+    const unsigned char *end = p + size;
+    struct pb_field f;
+    struct chunk_request c;
+    uint32_t count = 0;
+    int result;
+
+    while ((result = pb_next_field(&p, end, &f)) > 0) {
+	if (f.number != 1 || f.wire_type != WIRE_BYTES)
+	    continue;
+	if (parse_store_chunk(s, f.data, f.size, &c) || store_chunk(s, &c))
+	    return -1;
+	count++;
+    }
+    if (result < 0)
+	return bad_message(s);
+
+    return pb_put_uint(&s->inner, 1, count);
+}
+
+static int rpc_commit(struct store_server_ctx *s,
+		      const unsigned char *p, size_t size) {
+    const unsigned char *end = p + size, *sha256 = NULL;
+    struct pb_field f;
+    uint64_t length = 0;
+    int result, have_length = 0;
+
+    while ((result = pb_next_field(&p, end, &f)) > 0) {
+	if (f.number == 1 && f.wire_type == WIRE_BYTES &&
+		f.size == SHA256_SIZE) {
+	    sha256 = f.data;
+	} else if (f.number == 2 && f.wire_type == WIRE_VARINT) {
+	    length = f.value;
+	    have_length = 1;
+	}
+    }
+    if (result < 0)
+	return bad_message(s);
+
+    /* Commit now so that it is confirmed before the reply */
+    if (archive_db_begin(&s->db) ||
+	    archive_db_complete_member(&s->db, s->member_id, sha256,
+				       have_length, length) ||
+	    archive_db_commit(&s->db))
+	return -1;
+
+    if (sha256)
+	return pb_put_bytes(&s->inner, 1, sha256, SHA256_SIZE);
+    return 0;
+}
+
+static int rpc_set_compression(struct store_server_ctx *s,
+			       const unsigned char *p, size_t size) {
+    const unsigned char *end = p + size, *q;
+    struct pb_field f;
+    uint64_t codec, chosen = COMPRESSION_NONE;
+    int result, found = 0;
+
+    /* The first codec offered that we support, in the order offered. The
+     * codecs may be packed or not. */
+    while (!found && (result = pb_next_field(&p, end, &f)) > 0) {
+	if (f.number != 1)
+	    continue;
+	if (f.wire_type == WIRE_VARINT) {
+	    found = (f.value == COMPRESSION_NONE ||
+		     f.value == COMPRESSION_ZLIB);
+	    if (found)
+		chosen = f.value;
+	} else if (f.wire_type == WIRE_BYTES) {
+	    q = f.data;
+	    while (!found && q < f.data + f.size) {
+		if (pb_get_varint(&q, f.data + f.size, &codec))
+		    return bad_message(s);
+		found = (codec == COMPRESSION_NONE ||
+			 codec == COMPRESSION_ZLIB);
+		if (found)
+		    chosen = codec;
+	    }
+	}
+    }
+    if (!found && result < 0)
+	return bad_message(s);
+
+    return pb_put_uint(&s->inner, 1, chosen);
+}
+
+static int handle_request(struct store_server_ctx *s,
+			  const unsigned char *p, size_t size) {
+    const unsigned char *end = p + size;
+    struct pb_field f;
+    int result, rpc_result;
+    char length[24];
+
+    while ((result = pb_next_field(&p, end, &f)) > 0) {
+	if (f.wire_type != WIRE_BYTES)
+	    return bad_message(s);
+
+	s->inner.size = 0;
+	switch (f.number) {
+	    case REQUEST_HAVE_CHUNK:
+		rpc_result = rpc_have_chunk(s, f.data, f.size);
+		break;
+	    case REQUEST_STORE_CHUNK:
+		rpc_result = rpc_store_chunk(s, f.data, f.size);
+		break;
+	    case REQUEST_COMMIT:
+		rpc_result = rpc_commit(s, f.data, f.size);
+		break;
+	    case REQUEST_HAVE_CHUNKS:
+		rpc_result = rpc_have_chunks(s, f.data, f.size);
+		break;
+	    case REQUEST_STORE_CHUNKS:
+		rpc_result = rpc_store_chunks(s, f.data, f.size);
+		break;
+	    case REQUEST_SET_COMPRESSION:
+		rpc_result = rpc_set_compression(s, f.data, f.size);
+		break;
+	    default:
+		return fail(s, "unsupported request %u", f.number);
+	}
+	if (rpc_result)
+	    return -1;
+
+	/* Wrap in a Reply and frame as a netstring */
+	s->reply.size = 0;
+	if (pb_put_bytes(&s->reply, f.number, s->inner.data, s->inner.size))
+	    return fail(s, "out of memory");
+	sprintf(length, "%lu:", (unsigned long)s->reply.size);
+	if (buf_append(&s->out, length, strlen(length)) ||
+		buf_append(&s->out, s->reply.data, s->reply.size) ||
+		buf_append(&s->out, ",", 1))
+	    return fail(s, "out of memory");
+    }
+    if (result < 0)
+	return bad_message(s);
+    return 0;
+}
+
+/* Find the next complete netstring in the input buffer. Returns 1 if found,
+ * 0 if more input is needed or -1 if the input is malformed. */
+static int next_netstring(struct store_server_ctx *s,
+			  const unsigned char **msg, size_t *size) {
+    const unsigned char *p = s->in.data + s->in_pos;
+    const unsigned char *end = s->in.data + s->in.size;
+    const unsigned char *digits = p;
+    size_t n = 0;
+
+    if (p == end)
+	return 0;
+    if (*p == '0')
+	return fail(s, "malformed netstring");
+    while (p < end && *p >= '0' && *p <= '9') {
+	n = n * 10 + (*p++ - '0');
+	if (n > MAX_REQUEST_SIZE)
+	    return fail(s, "request too large");
+    }
+    if (p == end)
+	return 0;
+    if (*p++ != ':' || p == digits + 1)
+	return fail(s, "malformed netstring");
+    if ((size_t)(end - p) <= n) /* <= for the trailing ',' */
+	return 0;
+    if (p[n] != ',')
+	return fail(s, "malformed netstring");
+
+    *msg = p;
+    *size = n;
+    s->in_pos = p + n + 1 - s->in.data;
+    return 1;
+}
+
+static int serve(struct store_server_ctx *s) {
+    const unsigned char *msg = NULL;
+    size_t size = 0;
+    ssize_t n;
+    int result;
+
+    for (;;) {
+	/* Handle everything already received, then send all of the replies
+	 * together before blocking for more */
+	while ((result = next_netstring(s, &msg, &size)) > 0)
+	    if (handle_request(s, msg, size))
+		return -1;
+	if (result < 0)
+	    return -1;
+
+	if (s->out.size) {
+	    if (write_all(s->out_fd, s->out.data, s->out.size))
+		return fail(s, "remote process closed unexpectedly");
+	    s->out.size = 0;
+	}
+
+	if (s->in_pos) {
+	    memmove(s->in.data, s->in.data + s->in_pos,
+		    s->in.size - s->in_pos);
+	    s->in.size -= s->in_pos;
+	    s->in_pos = 0;
+	}
+	if (buf_reserve(&s->in, READ_SIZE))
+	    return fail(s, "out of memory");
+	do {
+	    n = read(s->in_fd, s->in.data + s->in.size, READ_SIZE);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+	    return fail(s, "read: %s", strerror(errno));
+	if (!n)
+	    return 0;
+	s->in.size += n;
+    }
+}
+
+/* Serve store requests for the member with id member_id in the archive in
+ * dirname, reading requests from in_fd and writing replies to out_fd until
+ * EOF, as Archive._StoreRPCServer.loop does after protocol negotiation. On
+ * error, returns -1 with a message in error. Whatever was stored is
+ * committed either way, unless an object file failed to be written, since
+ * the database must not refer to it. */
+int store_server(int in_fd, int out_fd, const char *dirname,
+		 int64_t member_id, int protocol_version,
+		 char *error, size_t error_size) {
+    struct store_server_ctx s;
+    int result = -1;
+
+    memset(&s, 0, sizeof(s));
+    s.in_fd = in_fd;
+    s.out_fd = out_fd;
+    s.member_id = member_id;
+    s.protocol_version = protocol_version;
+    s.error = error;
+    s.error_size = error_size;
+
+    if (archive_db_open(&s.db, dirname, error, error_size))
+	goto out;
+
+    result = serve(&s);
+    if (result)
+	archive_db_salvage(&s.db);
+    else
+	result = archive_db_commit(&s.db);
+
+out:
+    archive_db_close(&s.db);
+    free(s.in.data);
+    free(s.out.data);
+    free(s.reply.data);
+    free(s.inner.data);
+    free(s.data.data);
+    return result;
+}
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
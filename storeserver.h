@@ -0,0 +1,13 @@
+#ifndef STORESERVER_H
+#define STORESERVER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+int store_server(int in_fd, int out_fd, const char *dirname,
+		 int64_t member_id, int protocol_version,
+		 char *error, size_t error_size);
+
+#endif
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
@@ -14,11 +14,69 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+import threading
+
 import _dds
 
+# Scanners are kept for reuse when done with rather than freed, since each
+# has a large buffer. Up to this many are kept.
+SCANNER_POOL_SIZE = 4
+
+_scanner_pool = []
+_scanner_pool_lock = threading.Lock()
+
+def crc32c(data, crc=0):
+    '''Return the CRC-32C of data, continuing from crc if given.'''
+    return _dds.crc32c(data, crc)
+
+def store_server(in_fd, out_fd, dirname, member_id, protocol_version):
+    '''Serve store requests for member_id in the archive in dirname until EOF
+    on in_fd, without returning to python for each request. See
+    storeserver.c.'''
+    _dds.store_server(in_fd, out_fd, dirname, member_id, protocol_version)
+
+class Progress(object):
+    '''How far a store() has got, which another thread may read while it
+    runs.'''
+    def __init__(self):
+        self.h = _dds.progress_init()
+
+    def get(self):
+        '''Return (new_bytes, duplicate_bytes) stored so far.'''
+        return _dds.progress_get(self.h)
+
+def store(fd, dirname, member_id, aio=False, huge_pages=False,
+          progress=None):
+    '''Store the input on fd as member_id, newly added to the archive in
+    dirname, reading, chunking, hashing and writing it without returning to
+    python. See ingest.c. Returns the stats of each stage, as a dict. If
+    progress, a Progress, is given, then it is kept up to date.'''
+    if progress is None:
+        return _dds.store(fd, dirname, member_id, int(aio), int(huge_pages))
+    return _dds.store(fd, dirname, member_id, int(aio), int(huge_pages),
+                      progress.h)
+
+def probe_chunk_stored(offset, length, new):
+    '''Fire the chunk_stored tracepoint, as ingest.c does for each chunk.'''
+    _dds.probe_chunk_stored(offset, length, int(new))
+
+def probe_chunk_loaded(offset, length):
+    '''Fire the chunk_loaded tracepoint.'''
+    _dds.probe_chunk_loaded(offset, length)
+
 class DDS(object):
     def __init__(self):
-        self.h = _dds.init()
+        # Once chunks() has finished, a dict of the time spent reading and
+        # scanning, and how much was read
+        self.stats = None
+        _scanner_pool_lock.acquire()
+        try:
+            if _scanner_pool:
+                self.h = _scanner_pool.pop()
+            else:
+                self.h = _dds.init()
+        finally:
+            _scanner_pool_lock.release()
 
     def set_fd(self, fd):
         _dds.set_fd(self.h, fd)
@@ -29,6 +87,27 @@ class DDS(object):
     def set_aio(self):
         _dds.set_aio(self.h)
 
+    def set_io_thread(self):
+        '''Read ahead on a thread of its own, for an input that aio cannot
+        read, such as a pipe.'''
+        _dds.set_io_thread(self.h)
+
+    def set_huge_pages(self):
+        '''Back the buffer with huge pages where possible if the input is
+        large.'''
+        _dds.set_huge_pages(self.h)
+
+    def _release(self):
+        '''Return the scanner to the pool for another DDS to use.'''
+        _dds.reset(self.h)
+        _scanner_pool_lock.acquire()
+        try:
+            if len(_scanner_pool) < SCANNER_POOL_SIZE:
+                _scanner_pool.append(self.h)
+        finally:
+            _scanner_pool_lock.release()
+        self.h = None
+
     def begin(self):
         if not _dds.begin(self.h):
             raise RuntimeError('dds error')
@@ -42,6 +121,8 @@ class DDS(object):
             yield data
 
             if result & _dds.SCAN_CHUNK_LAST:
+                self.stats = _dds.stats(self.h)
+                self._release()
                 break
 
 # vim: set ts=8 sts=4 sw=4 ai et :
@@ -17,80 +17,188 @@
 #include <Python.h>
 
 #include "scan.h"
+#include "crc32c.h"
+#include "storeserver.h"
+#include "ingest.h"
+#include "probes.h"
 
-static PyObject *my_scan_init(PyObject *self, PyObject *args) {
+#define CRC32C_NOGIL_SIZE (1<<16)
+
+/* A scan context is used with the GIL released, so only one thread may use
+ * it at once. This is checked with busy, which is only read or written with
+ * the GIL held. */
+struct dds_scanner {
     struct scan_ctx *scan;
+    int busy;
+};
+
+static void scanner_free(void *p) {
+    struct dds_scanner *scanner = p;
+
+    scan_free(scanner->scan);
+    free(scanner);
+}
+
+/* Parse a scanner argument and claim it for this thread. Returns NULL with
+ * an exception set on failure; otherwise it must be released with
+ * scanner_release. */
+static struct dds_scanner *scanner_claim(PyObject *args) {
+    struct dds_scanner *scanner;
+    PyObject *cobj;
+
+    if (!PyArg_ParseTuple(args, "O!", &PyCObject_Type, &cobj))
+        return NULL;
+    scanner = PyCObject_AsVoidPtr(cobj);
+    if (scanner->busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "scanner is in use by another thread");
+        return NULL;
+    }
+    scanner->busy = 1;
+    return scanner;
+}
+
+static void scanner_release(struct dds_scanner *scanner) {
+    scanner->busy = 0;
+}
+
+static PyObject *my_scan_init(PyObject *self, PyObject *args) {
+    struct dds_scanner *scanner;
     PyObject *cobj;
 
-    scan = scan_init();
-    if (!scan)
+    scanner = malloc(sizeof(*scanner));
+    if (!scanner)
         return PyErr_NoMemory();
-    cobj = PyCObject_FromVoidPtr(scan, (void (*)(void *))scan_free);
+    scanner->busy = 0;
+    scanner->scan = scan_init();
+    if (!scanner->scan) {
+        free(scanner);
+        return PyErr_NoMemory();
+    }
+    cobj = PyCObject_FromVoidPtr(scanner, scanner_free);
     if (!cobj)
-        scan_free(scan);
+        scanner_free(scanner);
     return cobj;
 }
 
 static PyObject *my_scan_set_fd(PyObject *self, PyObject *args) {
-    struct scan_ctx *scan;
+    struct dds_scanner *scanner;
     PyObject *cobj;
     int fd;
 
     if (!PyArg_ParseTuple(args, "O!i", &PyCObject_Type, &cobj, &fd))
         return NULL;
-    scan = PyCObject_AsVoidPtr(cobj);
-    
-    scan_set_fd(scan, fd);
+    scanner = PyCObject_AsVoidPtr(cobj);
+    if (scanner->busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "scanner is in use by another thread");
+        return NULL;
+    }
+
+    scan_set_fd(scanner->scan, fd);
 
     Py_RETURN_NONE;
 }
 
 static PyObject *my_scan_set_aio(PyObject *self, PyObject *args) {
-    struct scan_ctx *scan;
-    PyObject *cobj;
+    struct dds_scanner *scanner;
 
-    if (!PyArg_ParseTuple(args, "O!", &PyCObject_Type, &cobj))
+    scanner = scanner_claim(args);
+    if (!scanner)
+        return NULL;
+    scan_set_aio(scanner->scan);
+    scanner_release(scanner);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *my_scan_set_io_thread(PyObject *self, PyObject *args) {
+    struct dds_scanner *scanner;
+
+    scanner = scanner_claim(args);
+    if (!scanner)
+        return NULL;
+    scan_set_io_thread(scanner->scan);
+    scanner_release(scanner);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *my_scan_reset(PyObject *self, PyObject *args) {
+    struct dds_scanner *scanner;
+
+    scanner = scanner_claim(args);
+    if (!scanner)
         return NULL;
-    scan = PyCObject_AsVoidPtr(cobj);
+    /* This waits for any read still in progress on the read thread */
+    Py_BEGIN_ALLOW_THREADS
+    scan_reset(scanner->scan);
+    Py_END_ALLOW_THREADS
+    scanner_release(scanner);
+
+    Py_RETURN_NONE;
+}
 
-    scan_set_aio(scan);
+static PyObject *my_scan_set_huge_pages(PyObject *self, PyObject *args) {
+    struct dds_scanner *scanner;
+
+    scanner = scanner_claim(args);
+    if (!scanner)
+        return NULL;
+    scan_set_huge_pages(scanner->scan);
+    scanner_release(scanner);
 
     Py_RETURN_NONE;
 }
 
 static PyObject *my_scan_begin(PyObject *self, PyObject *args) {
-    struct scan_ctx *scan;
-    PyObject *cobj;
+    struct dds_scanner *scanner;
+    int result;
 
-    if (!PyArg_ParseTuple(args, "O!", &PyCObject_Type, &cobj))
+    scanner = scanner_claim(args);
+    if (!scanner)
         return NULL;
-    scan = PyCObject_AsVoidPtr(cobj);
 
-    return PyInt_FromLong(scan_begin(scan));
+    /* This blocks on the first read */
+    Py_BEGIN_ALLOW_THREADS
+    result = scan_begin(scanner->scan);
+    Py_END_ALLOW_THREADS
+
+    scanner_release(scanner);
+    return PyInt_FromLong(result);
 }
 
 static PyObject *my_scan_read_chunk(PyObject *self, PyObject *args) {
-    struct scan_ctx *scan;
-    PyObject *cobj, *result_data[2], *final_result;
+    struct dds_scanner *scanner;
+    PyObject *result_data[2], *final_result;
     int result;
     struct scan_chunk_data scan_data[2];
 
-    if (!PyArg_ParseTuple(args, "O!", &PyCObject_Type, &cobj))
+    scanner = scanner_claim(args);
+    if (!scanner)
         return NULL;
-    scan = PyCObject_AsVoidPtr(cobj);
 
-    result = scan_read_chunk(scan, scan_data);
+    /* Reading and the rolling hash run without the GIL, so that other
+     * threads can store the chunks already found meanwhile. The chunk stays
+     * in the buffer until the next call, which cannot start until this
+     * thread has copied it out, as the scanner is still claimed. */
+    Py_BEGIN_ALLOW_THREADS
+    result = scan_read_chunk(scanner->scan, scan_data);
+    Py_END_ALLOW_THREADS
 
     if (result & SCAN_CHUNK_FOUND) {
         result_data[0] = PyString_FromStringAndSize((char *)scan_data[0].buf,
                                                     scan_data[0].size);
-        if (!result_data[0])
+        if (!result_data[0]) {
+            scanner_release(scanner);
             return NULL;
+        }
 
         result_data[1] = PyString_FromStringAndSize((char *)scan_data[1].buf,
                                                     scan_data[1].size);
         if (!result_data[1]) {
             Py_DECREF(result_data[0]);
+            scanner_release(scanner);
             return NULL;
         }
 
@@ -99,6 +207,7 @@ static PyObject *my_scan_read_chunk(PyObject *self, PyObject *args) {
         Py_INCREF(Py_None);
         result_data[0] = Py_None;
     }
+    scanner_release(scanner);
 
     final_result = Py_BuildValue("iN", result, result_data[0]);
     if (!final_result)
@@ -106,12 +215,205 @@ static PyObject *my_scan_read_chunk(PyObject *self, PyObject *args) {
     return final_result;
 }
 
+static PyObject *my_scan_stats(PyObject *self, PyObject *args) {
+    struct dds_scanner *scanner;
+    struct scan_stats stats;
+
+    scanner = scanner_claim(args);
+    if (!scanner)
+        return NULL;
+    scan_get_stats(scanner->scan, &stats);
+    scanner_release(scanner);
+
+    return Py_BuildValue("{s:{s:d,s:d},s:K,s:K,s:K}",
+                         "seconds",
+                         "read", stats.read_ns / 1e9,
+                         "scan", stats.scan_ns / 1e9,
+                         "bytes_read", (unsigned PY_LONG_LONG)stats.bytes_read,
+                         "reads", (unsigned PY_LONG_LONG)stats.reads,
+                         "chunks", (unsigned PY_LONG_LONG)stats.chunks);
+}
+
+/* Probes fired from python, for the store and load paths that are not run
+ * natively, so that the same tracing scripts work either way */
+static PyObject *my_probe_chunk_stored(PyObject *self, PyObject *args) {
+    unsigned PY_LONG_LONG offset;
+    int length, new;
+
+    if (!PyArg_ParseTuple(args, "Kii", &offset, &length, &new))
+        return NULL;
+    PROBE3(chunk_stored, offset, length, new);
+    Py_RETURN_NONE;
+}
+
+static PyObject *my_probe_chunk_loaded(PyObject *self, PyObject *args) {
+    unsigned PY_LONG_LONG offset;
+    int length;
+
+    if (!PyArg_ParseTuple(args, "Ki", &offset, &length))
+        return NULL;
+    PROBE2(chunk_loaded, offset, length);
+    Py_RETURN_NONE;
+}
+
+static PyObject *my_crc32c(PyObject *self, PyObject *args) {
+    const char *data;
+    int size;
+    unsigned long crc = 0;
+
+    if (!PyArg_ParseTuple(args, "s#|k", &data, &size, &crc))
+        return NULL;
+
+    /* Only worth giving up the GIL for a large buffer. data belongs to a
+     * string, which cannot change, held by args. */
+    if (size >= CRC32C_NOGIL_SIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        crc = crc32c(crc, (const unsigned char *)data, size);
+        Py_END_ALLOW_THREADS
+    } else
+        crc = crc32c(crc, (const unsigned char *)data, size);
+
+    return PyLong_FromUnsignedLong(crc);
+}
+
+static PyObject *my_store_server(PyObject *self, PyObject *args) {
+    int in_fd, out_fd, protocol_version, result;
+    const char *dirname;
+    PY_LONG_LONG member_id;
+    char error[256];
+
+    if (!PyArg_ParseTuple(args, "iisLi", &in_fd, &out_fd, &dirname,
+                          &member_id, &protocol_version))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    result = store_server(in_fd, out_fd, dirname, member_id,
+                          protocol_version, error, sizeof(error));
+    Py_END_ALLOW_THREADS
+
+    if (result) {
+        PyErr_SetString(PyExc_RuntimeError, error);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* The stats of ingest_store as a dict in the form that ddar's _Stats
+ * merges: times in seconds, and the histogram as a list of counts */
+static PyObject *ingest_stats_dict(const struct ingest_stats *stats) {
+    PyObject *histogram, *count;
+    int i;
+
+    histogram = PyList_New(INGEST_HISTOGRAM_BUCKETS);
+    if (!histogram)
+        return NULL;
+    for (i = 0; i < INGEST_HISTOGRAM_BUCKETS; i++) {
+        count = PyLong_FromUnsignedLongLong(stats->histogram[i]);
+        if (!count) {
+            Py_DECREF(histogram);
+            return NULL;
+        }
+        PyList_SET_ITEM(histogram, i, count);
+    }
+
+    return Py_BuildValue("{s:{s:d,s:d,s:d,s:d,s:d,s:d,s:d,s:d},"
+                         "s:K,s:K,s:K,s:K,s:N}",
+                         "seconds",
+                         "read", stats->read_ns / 1e9,
+                         "scan", stats->scan_ns / 1e9,
+                         "sha256", stats->sha256_ns / 1e9,
+                         "member_sha256", stats->member_sha256_ns / 1e9,
+                         "have_chunk", stats->have_chunk_ns / 1e9,
+                         "object_write", stats->object_write_ns / 1e9,
+                         "chunk_insert", stats->chunk_insert_ns / 1e9,
+                         "commit", stats->commit_ns / 1e9,
+                         "chunks", (unsigned PY_LONG_LONG)stats->chunks,
+                         "new_chunks", (unsigned PY_LONG_LONG)stats->new_chunks,
+                         "new_bytes", (unsigned PY_LONG_LONG)stats->new_bytes,
+                         "duplicate_bytes",
+                         (unsigned PY_LONG_LONG)stats->duplicate_bytes,
+                         "histogram", histogram);
+}
+
+/* Stats for ingest_store to fill in, which another thread may read with
+ * progress_get while it runs */
+static PyObject *my_progress_init(PyObject *self, PyObject *args) {
+    struct ingest_stats *stats;
+    PyObject *cobj;
+
+    stats = calloc(1, sizeof(*stats));
+    if (!stats)
+        return PyErr_NoMemory();
+    cobj = PyCObject_FromVoidPtr(stats, free);
+    if (!cobj)
+        free(stats);
+    return cobj;
+}
+
+static PyObject *my_progress_get(PyObject *self, PyObject *args) {
+    struct ingest_stats *stats;
+    PyObject *cobj;
+
+    if (!PyArg_ParseTuple(args, "O!", &PyCObject_Type, &cobj))
+        return NULL;
+    stats = PyCObject_AsVoidPtr(cobj);
+    return Py_BuildValue("KK",
+        (unsigned PY_LONG_LONG)__atomic_load_n(&stats->new_bytes,
+                                               __ATOMIC_RELAXED),
+        (unsigned PY_LONG_LONG)__atomic_load_n(&stats->duplicate_bytes,
+                                               __ATOMIC_RELAXED));
+}
+
+static PyObject *my_store(PyObject *self, PyObject *args) {
+    int fd, aio = 0, huge_pages = 0, result;
+    const char *dirname;
+    PY_LONG_LONG member_id;
+    struct ingest_stats local_stats, *stats = &local_stats;
+    PyObject *progress = NULL;
+    char error[256];
+
+    if (!PyArg_ParseTuple(args, "isL|iiO!", &fd, &dirname, &member_id, &aio,
+                          &huge_pages, &PyCObject_Type, &progress))
+        return NULL;
+    /* progress is held by args until this returns */
+    if (progress)
+        stats = PyCObject_AsVoidPtr(progress);
+
+    Py_BEGIN_ALLOW_THREADS
+    result = ingest_store(fd, dirname, member_id, aio, huge_pages,
+                          stats, error, sizeof(error));
+    Py_END_ALLOW_THREADS
+
+    if (result) {
+        PyErr_SetString(PyExc_RuntimeError, error);
+        return NULL;
+    }
+    return ingest_stats_dict(stats);
+}
+
 static PyMethodDef dds_methods[] = {
     { "init", my_scan_init, METH_VARARGS, "scan_init" },
     { "set_fd", my_scan_set_fd, METH_VARARGS, "scan_set_fd" },
     { "set_aio", my_scan_set_aio, METH_VARARGS, "scan_set_aio" },
+    { "set_io_thread", my_scan_set_io_thread, METH_VARARGS,
+        "scan_set_io_thread" },
+    { "set_huge_pages", my_scan_set_huge_pages, METH_VARARGS,
+        "scan_set_huge_pages" },
+    { "reset", my_scan_reset, METH_VARARGS, "scan_reset" },
     { "begin", my_scan_begin, METH_VARARGS, "scan_begin" },
     { "read_chunk", my_scan_read_chunk, METH_VARARGS, "scan_read_chunk" },
+    { "stats", my_scan_stats, METH_VARARGS, "scan_get_stats" },
+    { "crc32c", my_crc32c, METH_VARARGS, "crc32c" },
+    { "store_server", my_store_server, METH_VARARGS, "store_server" },
+    { "store", my_store, METH_VARARGS, "ingest_store" },
+    { "progress_init", my_progress_init, METH_VARARGS,
+        "allocate stats for ingest_store" },
+    { "progress_get", my_progress_get, METH_VARARGS,
+        "read the progress of ingest_store" },
+    { "probe_chunk_stored", my_probe_chunk_stored, METH_VARARGS,
+        "fire the chunk_stored probe" },
+    { "probe_chunk_loaded", my_probe_chunk_loaded, METH_VARARGS,
+        "fire the chunk_loaded probe" },
     { NULL, NULL, 0, NULL }
 };
 
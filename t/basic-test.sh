@@ -72,3 +72,259 @@ it_will_not_shell_out_for_source() {
 	ddar cf archive \!false && false
 	test $? -eq 2
 }
+
+it_quick_fscks_an_archive() {
+	ddar cf archive < "$ddar_src/test/corpus0"
+	ddar --fsck --quick archive
+}
+
+it_detects_bit_rot_with_quick_fsck() {
+	echo foo|ddar cf archive
+	object=`find archive/objects -type f`
+	chmod u+w "$object"
+	echo bar > "$object"
+	! ddar --fsck --quick archive
+}
+
+it_will_not_quick_check_except_in_fsck() {
+	echo foo|ddar cf archive
+	ddar tf archive --quick && false
+	test $? -eq 2
+}
+
+it_syncs_an_archive() {
+	echo foo|ddar cf archive -N foo
+	ddar cf archive -N corpus0 < "$ddar_src/test/corpus0"
+	ddar --sync archive copy
+	[ `ddar xf copy foo` = foo ]
+	ddar xf copy corpus0|cmp - "$ddar_src/test/corpus0"
+	echo bar|ddar cf archive -N bar
+	ddar --sync archive copy
+	[ `ddar xf copy` = bar ]
+	fsck copy
+}
+
+it_will_not_sync_over_a_different_member() {
+	echo foo|ddar cf archive -N foo
+	echo bar|ddar cf copy -N foo
+	ddar --sync archive copy && false
+	test $? -eq 1
+	[ `ddar xf copy foo` = bar ]
+}
+
+start_daemon() {
+	ddar --daemon archive &
+	daemon_pid=$!
+	while [ ! -S archive/socket ]; do sleep 0.1; done
+}
+
+it_stores_through_a_daemon() {
+	start_daemon
+	echo foo|ddar c --socket archive/socket -N foo
+	echo bar > bar
+	echo baz > baz
+	ddar c --socket archive/socket bar baz
+	# Without a name, the daemon names the member by the date
+	echo qux|ddar c --socket archive/socket
+	kill $daemon_pid
+	[ `ddar xf archive foo` = foo ]
+	[ `ddar xf archive bar` = bar ]
+	[ `ddar xf archive baz` = baz ]
+	[ `ddar xf archive \`date +%Y-%m-%d\`` = qux ]
+	fsck archive
+}
+
+it_stores_the_same_data_from_concurrent_daemon_clients() {
+	start_daemon
+	clients=
+	for n in 1 2 3 4; do
+		ddar c --socket archive/socket -N c$n < "$ddar_src/test/corpus0" &
+		clients="$clients $!"
+	done
+	wait $clients
+	kill $daemon_pid
+	for n in 1 2 3 4; do
+		ddar xf archive c$n|cmp - "$ddar_src/test/corpus0"
+	done
+	ddar cf single < "$ddar_src/test/corpus0"
+	[ `find archive/objects -type f|wc -l` = \
+	  `find single/objects -type f|wc -l` ]
+	fsck archive
+}
+
+# Store the first bytes of file as member, left as an interrupted store would
+# leave it
+store_incomplete() {
+	head -c $3 "$2"|ddar cf archive -N "$1"
+	python -c "import sqlite3; db = sqlite3.connect('archive/db'); db.execute('UPDATE member SET hash=NULL, length=NULL WHERE name=?', ('$1',)); db.commit()"
+}
+
+it_resumes_a_store_from_a_file() {
+	cp "$ddar_src/test/corpus0" corpus0
+	store_incomplete corpus0 corpus0 1000000
+	ddar cf archive corpus0 --resume
+	ddar xf archive corpus0|cmp - corpus0
+	fsck archive
+}
+
+it_resumes_a_store_from_a_pipe() {
+	store_incomplete foo "$ddar_src/test/corpus0" 1000000
+	ddar cf archive -N foo --resume < "$ddar_src/test/corpus0"
+	ddar xf archive foo|cmp - "$ddar_src/test/corpus0"
+	fsck archive
+}
+
+it_will_not_resume_from_a_pipe_that_differs() {
+	store_incomplete foo "$ddar_src/test/corpus0" 1000000
+	{ echo changed; tail -c +9 "$ddar_src/test/corpus0"; }|
+		ddar cf archive -N foo --resume && false
+	test $? -eq 1
+	[ -z "`python -c "import sqlite3; print sqlite3.connect('archive/db').execute('SELECT hash FROM member').fetchone()[0] or ''"`" ]
+}
+
+it_will_not_resume_a_complete_member() {
+	echo foo|ddar cf archive -N foo
+	echo foo|ddar cf archive -N foo --resume && false
+	test $? -eq 1
+}
+
+it_stores_several_members_at_once() {
+	for n in 1 2 3 4 5 6; do
+		head -c ${n}00000 "$ddar_src/test/corpus0" > part$n
+	done
+	ddar cf archive part* -j 3
+	for n in 1 2 3 4 5 6; do
+		ddar xf archive part$n|cmp - part$n
+	done
+	fsck archive
+}
+
+it_stops_storing_at_once_after_an_error() {
+	echo foo > foo
+	echo bar > bar
+	ddar cf archive foo
+	ddar cf archive foo bar -j 1 && false
+	test $? -eq 1
+	[ `ddar tf archive|wc -l` = 1 ]
+}
+
+it_stores_with_huge_pages() {
+	DDAR_HUGE_PAGES=1 ddar cf archive -N corpus0 < "$ddar_src/test/corpus0"
+	ddar xf archive corpus0|cmp - "$ddar_src/test/corpus0"
+}
+
+# Print the rows and object files of the archive in $1 that a store writes
+dump_archive() {
+	python -c "import sqlite3; db = sqlite3.connect('$1/db')
+for row in db.execute('SELECT name, hex(member.hash), member.length, hex(chunk.hash), offset, chunk.length FROM member JOIN chunk ON member_id=id ORDER BY id, offset'): print row
+for row in db.execute('SELECT hex(hash), crc32c FROM object ORDER BY hash'): print row"
+	(cd "$1" && find objects -type f|sort|xargs md5sum)
+}
+
+it_stores_the_same_archive_as_the_python_store() {
+	for store in native python; do
+		[ $store = python ] && export DDAR_PYTHON_STORE=1
+		ddar cf $store -N corpus0 < "$ddar_src/test/corpus0"
+		head -c 1000000 "$ddar_src/test/corpus0"|ddar cf $store -N part
+		: |ddar cf $store -N empty
+		ddar cf $store "$ddar_src/test/corpus0" -N again
+	done
+	dump_archive native > native.dump
+	dump_archive python > python.dump
+	cmp native.dump python.dump
+	fsck native
+}
+
+it_reads_a_read_only_archive_from_before_crcs_were_recorded() {
+	ddar cf archive -N corpus0 < "$ddar_src/test/corpus0"
+	python -c "import sqlite3; db = sqlite3.connect('archive/db')
+db.execute('DROP TABLE object'); db.commit()"
+	chmod -R a-w archive
+	status=0
+	{ ddar xf archive corpus0|cmp - "$ddar_src/test/corpus0" &&
+	  [ "`ddar tf archive`" = corpus0 ] &&
+	  fsck archive && ddar --fsck --quick archive &&
+	  [ "`ddar --sha256sum archive`" = \
+	    "`cd "$ddar_src/test" && sha256sum corpus0`" ]; } || status=1
+	chmod -R u+w archive
+	[ $status = 0 ]
+	# The first write adds the table, and a full check fills it in
+	echo foo|ddar cf archive -N foo
+	fsck archive
+	[ `python -c "import sqlite3; print sqlite3.connect('archive/db').execute('SELECT COUNT(*) FROM object').fetchone()[0]"` = \
+	  `find archive/objects -type f|wc -l` ]
+}
+
+it_stores_no_rows_for_objects_that_failed_to_be_written() {
+	echo foo|ddar cf archive -N foo
+	for n in `seq 0 255`; do
+		dir=archive/objects/`printf %02x $n`
+		[ -e $dir ] || touch $dir
+	done
+	ddar cf archive -N corpus0 < "$ddar_src/test/corpus0" && false
+	[ `python -c "import sqlite3; print sqlite3.connect('archive/db').execute('SELECT COUNT(*) FROM chunk').fetchone()[0]"` = 1 ]
+}
+
+it_prints_stats_when_storing_and_extracting() {
+	ddar cf archive -N A --stats < "$ddar_src/test/corpus0" 2> stats
+	grep -q "^duplicate_bytes *0$" stats
+	DDAR_PYTHON_STORE=1 ddar cf archive -N B --stats-json stats.json \
+		< "$ddar_src/test/corpus0"
+	python -c "import json; s = json.load(open('stats.json'))
+assert s['new_bytes'] == 0
+assert s['duplicate_bytes'] == `stat -c %s "$ddar_src/test/corpus0"`
+assert s['chunks'] == sum(s['histogram'].values())"
+	ddar xf archive A --stats 2> stats > /dev/null
+	grep -q "^object_read" stats
+}
+
+it_reports_progress_when_storing_and_extracting() {
+	size=`stat -c %s "$ddar_src/test/corpus0"`
+	ddar cf archive -N A --progress-fd 3 3> progress \
+		< "$ddar_src/test/corpus0"
+	python -c "import json
+p = json.loads(open('progress').readlines()[-1])
+assert p['done'] and p['member'] == 'A'
+assert p['bytes'] == p['total'] == p['new_bytes'] == $size"
+	DDAR_PYTHON_STORE=1 ddar cf archive -N B --progress-fd 3 3> progress \
+		< "$ddar_src/test/corpus0"
+	python -c "import json
+p = json.loads(open('progress').readlines()[-1])
+assert p['done'] and p['bytes'] == $size and p['new_bytes'] == 0"
+	ddar xf archive A --progress 2> progress > /dev/null
+	grep -q "^A: .* of .* MB" progress
+}
+
+it_extracts_several_members_to_a_directory() {
+	head -c 1000000 "$ddar_src/test/corpus0" > part
+	ddar cf archive -N day1 < "$ddar_src/test/corpus0"
+	ddar cf archive -N sub/day2 < "$ddar_src/test/corpus0"
+	ddar cf archive -N day3 < part
+	ddar xf archive day1 sub/day2 day3 --directory out --stats-json stats.json
+	cmp out/day1 "$ddar_src/test/corpus0"
+	cmp out/sub/day2 "$ddar_src/test/corpus0"
+	cmp out/day3 part
+	chunks=`python -c "import sqlite3; print sqlite3.connect('archive/db').execute('SELECT COUNT(*) FROM chunk').fetchone()[0]"`
+	objects=`find archive/objects -type f|wc -l`
+	python -c "import json; s = json.load(open('stats.json'))
+assert s['chunks'] == $chunks
+assert s['cached_chunks'] == $chunks - $objects"
+	ddar xf archive day1 day3 > both
+	cat "$ddar_src/test/corpus0" part|cmp - both
+	# A chunk with no use to come is not cached, so the unique data between
+	# two extracts of day3 does not push day3 out of the cache
+	head -c 3000000 /dev/urandom|ddar cf archive -N unique
+	ddar cf archive -N day4 < part
+	part_chunks=`python -c "import sqlite3; print sqlite3.connect('archive/db').execute('SELECT COUNT(*) FROM chunk JOIN member ON member_id=id WHERE name=?', ('day3',)).fetchone()[0]"`
+	for last in day4 day3; do
+		ddar xf archive day3 unique $last --cache-size 2 \
+			--stats-json stats.json > three
+		python -c "import json; s = json.load(open('stats.json'))
+assert s['cached_chunks'] == $part_chunks, s['cached_chunks']"
+	done
+	echo foo|ddar cf archive -N ../escape
+	mkdir -p deeper/out
+	ddar xf archive ../escape --directory deeper/out && false
+	test $? -eq 1
+	[ ! -e deeper/escape ]
+}
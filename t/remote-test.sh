@@ -70,3 +70,88 @@ it_will_not_shell_out_for_source() {
 	ddar -cf localhost:archive \!false && false
 	test $? -eq 2
 }
+
+it_stores_and_extracts_with_compression() {
+	ddar -cf localhost:archive --compression zlib < "$DDAR_SRC/ddar.1.xml"
+	ddar -xf $REMOTE_TOP/archive|cmp - "$DDAR_SRC/ddar.1.xml"
+	ddar -cf localhost:archive --compression none -N plain < "$DDAR_SRC/ddar.1.xml"
+	ddar -xf $REMOTE_TOP/archive plain|cmp - "$DDAR_SRC/ddar.1.xml"
+	fsck $REMOTE_TOP/archive
+}
+
+it_extracts_from_a_remote_archive() {
+	ddar -cf localhost:archive < "$DDAR_SRC/test/corpus0"
+	echo foo|ddar -cf localhost:archive -N foo
+	[ `ddar -xf localhost:archive foo` = foo ]
+	[ `ddar -xf localhost:archive` = foo ]
+}
+
+it_will_not_extract_a_missing_member_from_a_remote_archive() {
+	echo foo|ddar -cf localhost:archive -N foo
+	ddar -xf localhost:archive bar && false
+	test $? -eq 1
+}
+
+it_extracts_a_large_member_from_a_remote_archive() {
+	ddar -cf localhost:archive -N corpus0 < "$DDAR_SRC/test/corpus0"
+	ddar -xf localhost:archive corpus0|cmp - "$DDAR_SRC/test/corpus0"
+	ddar -xf localhost:archive --window-size 0 corpus0|cmp - "$DDAR_SRC/test/corpus0"
+	ddar -xf localhost:archive --compression zlib corpus0|cmp - "$DDAR_SRC/test/corpus0"
+}
+
+it_extracts_several_members_from_a_remote_archive() {
+	head -c 1000000 "$DDAR_SRC/test/corpus0" > part
+	ddar -cf localhost:archive -N corpus0 < "$DDAR_SRC/test/corpus0"
+	ddar -cf localhost:archive -N part < part
+	ddar -xf localhost:archive part corpus0 part --stats-json stats.json > all
+	cat part "$DDAR_SRC/test/corpus0" part|cmp - all
+	python -c "import json; s = json.load(open('stats.json'))
+assert s['cached_chunks'] > 0"
+	ddar -xf localhost:archive part corpus0 --directory out
+	cmp out/part part
+	cmp out/corpus0 "$DDAR_SRC/test/corpus0"
+}
+
+it_extracts_from_a_remote_archive_with_a_reference() {
+	ddar -cf localhost:archive -N corpus0 < "$DDAR_SRC/test/corpus0"
+	head -c 100000 "$DDAR_SRC/test/corpus0"|ddar -cf reference
+	ddar -xf localhost:archive --reference reference corpus0|cmp - "$DDAR_SRC/test/corpus0"
+}
+
+it_will_not_use_a_reference_except_in_extract() {
+	echo foo|ddar -cf archive --reference archive && false
+	test $? -eq 2
+}
+
+it_syncs_to_a_remote_archive() {
+	ddar -cf archive -N corpus0 < "$DDAR_SRC/test/corpus0"
+	ddar --sync archive localhost:copy
+	ddar -xf $REMOTE_TOP/copy corpus0|cmp - "$DDAR_SRC/test/corpus0"
+	echo foo|ddar -cf archive -N foo
+	ddar --sync archive localhost:copy --compression zlib
+	[ `ddar -xf $REMOTE_TOP/copy foo` = foo ]
+	fsck $REMOTE_TOP/copy
+}
+
+it_stores_with_the_python_store_server() {
+	DDAR_PYTHON_STORE_SERVER=1 ddar -cf localhost:archive < "$DDAR_SRC/test/corpus0"
+	ddar -cf localhost:archive -N again < "$DDAR_SRC/test/corpus0"
+	ddar -xf $REMOTE_TOP/archive again|cmp - "$DDAR_SRC/test/corpus0"
+	fsck $REMOTE_TOP/archive
+}
+
+it_resumes_a_store_to_a_remote_archive() {
+	head -c 1000000 "$DDAR_SRC/test/corpus0"|ddar -cf localhost:archive -N foo
+	python -c "import sqlite3; db = sqlite3.connect('$REMOTE_TOP/archive/db'); db.execute('UPDATE member SET hash=NULL, length=NULL'); db.commit()"
+	ddar -cf localhost:archive -N foo --resume < "$DDAR_SRC/test/corpus0"
+	ddar -xf $REMOTE_TOP/archive foo|cmp - "$DDAR_SRC/test/corpus0"
+	fsck $REMOTE_TOP/archive
+}
+
+it_will_not_resume_a_remote_store_from_a_pipe_that_differs() {
+	head -c 1000000 "$DDAR_SRC/test/corpus0"|ddar -cf localhost:archive -N foo
+	python -c "import sqlite3; db = sqlite3.connect('$REMOTE_TOP/archive/db'); db.execute('UPDATE member SET hash=NULL, length=NULL'); db.commit()"
+	{ echo changed; tail -c +9 "$DDAR_SRC/test/corpus0"; }|
+		ddar -cf localhost:archive -N foo --resume && false
+	test $? -eq 1
+}
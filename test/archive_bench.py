@@ -0,0 +1,179 @@
+#!/usr/bin/python
+
+# Copyright 2010-2011 True Blue Logic Ltd
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of version 3 of the GNU General Public License as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+'''Time ddar end to end on a series of versions of a corpus.
+
+The first version is made by random from seed1, and each later version by
+mutate from the one before, so that the series is the same on every run.
+Each version is stored as a member of one archive, and then the last is
+extracted and checked, the archive is checked with --fsck and the first
+member is deleted.
+
+One line of CSV is printed for each operation, with how long it took, the
+peak RSS of ddar, and the state of the archive afterwards, so that results
+can be kept and compared across releases. Many versions of a large corpus
+push the archive to millions of chunks, to show where it stops scaling.'''
+
+import filecmp, optparse, os, os.path, shutil, sqlite3, subprocess, sys
+import tempfile, time
+
+FIELDS = [ 'operation', 'member', 'seconds', 'mb_per_s', 'peak_rss_kb',
+           'input_bytes', 'unique_bytes', 'dedup_ratio', 'db_bytes',
+           'objects', 'chunks' ]
+
+def run(args, stdin=None, stdout=None):
+    '''Run args, returning (seconds, peak RSS in KiB).'''
+    start = time.time()
+    p = subprocess.Popen(args, stdin=stdin, stdout=stdout)
+    pid, status, rusage = os.wait4(p.pid, 0)
+    seconds = time.time() - start
+    p.returncode = status
+    if status:
+        raise RuntimeError('%s failed with status %d' % (' '.join(args),
+                                                         status))
+    return seconds, rusage.ru_maxrss
+
+def run_file(args, input_filename, output_filename=None):
+    '''Run args with input from input_filename, and output to
+    output_filename if given.'''
+    stdin = open(input_filename, 'rb')
+    try:
+        if output_filename is None:
+            return run(args, stdin=stdin)
+        stdout = open(output_filename, 'wb')
+        try:
+            return run(args, stdin=stdin, stdout=stdout)
+        finally:
+            stdout.close()
+    finally:
+        stdin.close()
+
+def archive_stats(archive):
+    '''Return a dict of the archive fields of FIELDS.'''
+    db = sqlite3.connect(os.path.join(archive, 'db'))
+    try:
+        c = db.cursor()
+        c.execute('SELECT COALESCE(SUM(length), 0) FROM member')
+        input_bytes = c.fetchone()[0]
+        c.execute('SELECT COALESCE(SUM(length), 0) FROM ' +
+                  '(SELECT DISTINCT hash, length FROM chunk)')
+        unique_bytes = c.fetchone()[0]
+        c.execute('SELECT COUNT(*) FROM object')
+        objects = c.fetchone()[0]
+        c.execute('SELECT COUNT(*) FROM chunk')
+        chunks = c.fetchone()[0]
+        c.close()
+    finally:
+        db.close()
+    if unique_bytes:
+        dedup_ratio = '%.3f' % (float(input_bytes) / unique_bytes)
+    else:
+        dedup_ratio = ''
+    return { 'input_bytes': input_bytes, 'unique_bytes': unique_bytes,
+             'dedup_ratio': dedup_ratio, 'objects': objects,
+             'chunks': chunks,
+             'db_bytes': os.stat(os.path.join(archive, 'db')).st_size }
+
+def report(archive, operation, member, seconds, peak_rss, nbytes=None):
+    row = archive_stats(archive)
+    row.update({ 'operation': operation, 'member': member,
+                 'seconds': '%.3f' % seconds, 'peak_rss_kb': peak_rss })
+    if nbytes is None:
+        row['mb_per_s'] = ''
+    else:
+        row['mb_per_s'] = '%.1f' % (nbytes / seconds / 1e6)
+    print ','.join([ str(row[field]) for field in FIELDS ])
+    sys.stdout.flush()
+
+def bench(options, workdir):
+    here = os.path.dirname(os.path.abspath(__file__))
+    ddar = os.path.abspath(options.ddar)
+    archive = os.path.join(workdir, 'archive')
+    version = None
+
+    print ','.join(FIELDS)
+    for i in xrange(options.versions):
+        previous = version
+        version = os.path.join(workdir, 'v%d' % i)
+        if previous is None:
+            run_file([ os.path.join(here, 'random'), str(options.size) ],
+                     os.path.join(here, 'seed1'), version)
+        else:
+            run_file([ os.path.join(here, 'mutate'), str(options.seed + i),
+                       str(options.gap) ], previous, version)
+            os.unlink(previous)
+
+        member = 'v%d' % i
+        seconds, peak_rss = run_file([ ddar, 'cf', archive, '-N', member ],
+                                     version)
+        report(archive, 'store', member, seconds, peak_rss,
+               os.stat(version).st_size)
+
+    extracted = os.path.join(workdir, 'extracted')
+    f = open(extracted, 'wb')
+    try:
+        seconds, peak_rss = run([ ddar, 'xf', archive, member ], stdout=f)
+    finally:
+        f.close()
+    if not filecmp.cmp(version, extracted, shallow=False):
+        raise RuntimeError('%s extracted wrongly' % member)
+    report(archive, 'extract', member, seconds, peak_rss,
+           os.stat(extracted).st_size)
+    os.unlink(extracted)
+
+    unique_bytes = archive_stats(archive)['unique_bytes']
+    seconds, peak_rss = run([ ddar, '--fsck', archive ])
+    report(archive, 'fsck', '', seconds, peak_rss, unique_bytes)
+
+    seconds, peak_rss = run([ ddar, 'df', archive, 'v0' ])
+    report(archive, 'delete', 'v0', seconds, peak_rss)
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]',
+                                   description=__doc__.split('\n')[0])
+    parser.add_option('--size', type='int', default=1 << 26,
+                      help='size of the first version in bytes')
+    parser.add_option('--versions', type='int', default=8,
+                      help='number of versions to store')
+    parser.add_option('--gap', type='int', default=1 << 22,
+                      help='mean number of bytes between edits')
+    parser.add_option('--seed', type='int', default=1,
+                      help='seed for the edits, plus the version number')
+    parser.add_option('--ddar', default=os.path.join(
+                          os.path.dirname(os.path.abspath(__file__)), '..',
+                          'ddar'),
+                      help='ddar to benchmark')
+    parser.add_option('--dir', help='directory to work in, which is kept ' +
+                      '(default: a temporary directory)')
+    options, args = parser.parse_args()
+    if args or options.versions < 1:
+        parser.error('bad arguments')
+
+    if options.dir:
+        if not os.path.isdir(options.dir):
+            os.mkdir(options.dir)
+        bench(options, options.dir)
+    else:
+        workdir = tempfile.mkdtemp(prefix='ddar-bench.')
+        try:
+            bench(options, workdir)
+        finally:
+            shutil.rmtree(workdir)
+
+if __name__ == '__main__':
+    main()
+
+# vim: set ts=8 sts=4 sw=4 ai et :
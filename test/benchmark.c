@@ -0,0 +1,296 @@
+/*
+   Copyright 2010-2011 True Blue Logic Ltd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of version 3 of the GNU General Public License as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measure the throughput of the hot loops of chunking: the rolling hash,
+ * finding chunk boundaries with scan.c in each I/O mode, and sha256 over
+ * a range of buffer sizes.
+ *
+ * Each benchmark is run once to warm up (and to get the corpus into the
+ * page cache), and then the best of ROUNDS runs is reported, so that this
+ * measures the code rather than the disk. The results are printed as CSV
+ * with a header line, one line per benchmark, so that they can be kept and
+ * compared across releases. cycles_per_byte is counted with the time stamp
+ * counter, and is left empty where there isn't one.
+ *
+ * Usage: benchmark corpus */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "rabin.h"
+#include "scan.h"
+#include "sha2.h"
+
+#define ROUNDS 3
+
+/* How much of the corpus the in-memory benchmarks use */
+#define MEMORY_BYTES (1<<26)
+
+/* The window size that scan.c uses */
+#define WINDOW_SIZE 48
+
+/* Keeps the compiler from optimising away hashes that are not used */
+static volatile uint32_t sink;
+
+static const char *corpus;
+static unsigned char *memory;
+static size_t memory_size;
+
+struct timer {
+    struct timespec ts;
+#ifdef HAVE_TSC
+    uint64_t tsc;
+#endif
+};
+
+static void timer_read(struct timer *t) {
+    clock_gettime(CLOCK_MONOTONIC, &t->ts);
+#ifdef HAVE_TSC
+    t->tsc = __rdtsc();
+#endif
+}
+
+static double timer_seconds(const struct timer *start,
+			    const struct timer *end) {
+    return (end->ts.tv_sec - start->ts.tv_sec) +
+	(end->ts.tv_nsec - start->ts.tv_nsec) / 1e9;
+}
+
+/* Runs fn, which returns the number of bytes it processed or -1 on error,
+ * and prints the best of ROUNDS runs. Returns 0 on error. */
+static int measure(const char *name, const char *parameter,
+		   long long (*fn)(const void *), const void *arg) {
+    struct timer start, end;
+    double seconds, best_seconds = 0;
+    uint64_t cycles = 0, best_cycles = 0;
+    long long bytes;
+    int i;
+
+    if (fn(arg) < 0)
+	return 0;
+    for (i=0; i<ROUNDS; i++) {
+	timer_read(&start);
+	bytes = fn(arg);
+	timer_read(&end);
+	if (bytes <= 0)
+	    return 0;
+	seconds = timer_seconds(&start, &end);
+#ifdef HAVE_TSC
+	cycles = end.tsc - start.tsc;
+#endif
+	if (!i || seconds < best_seconds) {
+	    best_seconds = seconds;
+	    best_cycles = cycles;
+	}
+    }
+
+    printf("%s,%s,%lld,%.6f,%.1f,", name, parameter, bytes, best_seconds,
+	   bytes / best_seconds / 1e6);
+#ifdef HAVE_TSC
+    printf("%.3f", (double)best_cycles / bytes);
+#endif
+    putchar('\n');
+    fflush(stdout);
+    return 1;
+}
+
+/* rabin_hash of the window at every position, as if there were no
+ * rolling hash */
+static long long bench_rabin_hash(const void *arg) {
+    struct rabin_ctx *ctx;
+    uint32_t hash = 0;
+    size_t i, n;
+
+    ctx = rabin_init(RABIN_A, WINDOW_SIZE);
+    if (!ctx)
+	return -1;
+    /* rabin_hash is k times the work of rolling, so do less of it */
+    n = (memory_size - WINDOW_SIZE) / 16;
+    for (i=0; i<n; i++)
+	hash ^= rabin_hash(ctx, memory + i);
+    sink = hash;
+    rabin_free(ctx);
+    return n;
+}
+
+static long long bench_rabin_hash_next(const void *arg) {
+    struct rabin_ctx *ctx;
+    uint32_t hash;
+    size_t i;
+
+    ctx = rabin_init(RABIN_A, WINDOW_SIZE);
+    if (!ctx)
+	return -1;
+    hash = rabin_hash(ctx, memory);
+    for (i=WINDOW_SIZE; i<memory_size; i++)
+	hash = rabin_hash_next(ctx, hash, memory[i-WINDOW_SIZE], memory[i]);
+    sink = hash;
+    rabin_free(ctx);
+    return memory_size - WINDOW_SIZE;
+}
+
+/* The specialised kernel that scan.c uses in place of rabin_hash_next */
+static long long bench_rabin_hash_next_48(const void *arg) {
+    struct rabin_ctx *ctx;
+    uint32_t hash;
+    size_t i;
+
+    ctx = rabin_init(RABIN_A, WINDOW_SIZE);
+    if (!ctx)
+	return -1;
+    hash = rabin_hash(ctx, memory);
+    rabin_free(ctx);
+    for (i=WINDOW_SIZE; i<memory_size; i++)
+	hash = rabin_hash_next_48(hash, memory[i-WINDOW_SIZE], memory[i]);
+    sink = hash;
+    return memory_size - WINDOW_SIZE;
+}
+
+static long long bench_sha256_update(const void *arg) {
+    size_t size = *(const size_t *)arg, offset;
+    sha256_ctx sha256;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+
+    sha256_init(&sha256);
+    for (offset=0; offset+size<=memory_size; offset+=size)
+	sha256_update(&sha256, memory + offset, size);
+    sha256_final(&sha256, digest);
+    sink = digest[0];
+    return offset;
+}
+
+struct scan_mode {
+    const char *name;
+    void (*set)(struct scan_ctx *);
+};
+
+static const struct scan_mode scan_modes[] = {
+    { "sync", NULL },
+    { "aio", scan_set_aio },
+    { "thread", scan_set_io_thread },
+};
+
+/* Scan the whole corpus */
+static long long bench_scan_read_chunk(const void *arg) {
+    const struct scan_mode *mode = arg;
+    struct scan_ctx *scan;
+    struct scan_chunk_data chunk_data[2];
+    long long bytes = 0;
+    int fd, result;
+
+    fd = open(corpus, O_RDONLY);
+    if (fd < 0) {
+	perror(corpus);
+	return -1;
+    }
+    scan = scan_init();
+    if (!scan) {
+	close(fd);
+	return -1;
+    }
+    scan_set_fd(scan, fd);
+    if (mode->set)
+	mode->set(scan);
+    if (!scan_begin(scan))
+	bytes = -1;
+    else do {
+	result = scan_read_chunk(scan, chunk_data);
+	if (!(result & SCAN_CHUNK_FOUND)) {
+	    bytes = -1;
+	    break;
+	}
+	bytes += chunk_data[0].size + chunk_data[1].size;
+    } while (!(result & SCAN_CHUNK_LAST));
+    scan_free(scan);
+    close(fd);
+    return bytes;
+}
+
+static int read_corpus(void) {
+    FILE *f;
+
+    memory = malloc(MEMORY_BYTES);
+    if (!memory) {
+	perror("malloc");
+	return 0;
+    }
+    f = fopen(corpus, "rb");
+    if (!f) {
+	perror(corpus);
+	return 0;
+    }
+    memory_size = fread(memory, 1, MEMORY_BYTES, f);
+    if (ferror(f)) {
+	perror(corpus);
+	fclose(f);
+	return 0;
+    }
+    fclose(f);
+    if (memory_size < (1<<20)) {
+	fprintf(stderr, "%s: corpus too small\n", corpus);
+	return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    static const size_t sha256_sizes[] = { 64, 1024, 16384, 65536, 1<<20 };
+    char parameter[32];
+    size_t i;
+
+    if (argc != 2) {
+	fputs("Usage: benchmark corpus\n", stderr);
+	return 2;
+    }
+    corpus = argv[1];
+    if (!read_corpus())
+	return 1;
+
+    puts("benchmark,parameter,bytes,seconds,mb_per_s,cycles_per_byte");
+    snprintf(parameter, sizeof(parameter), "%d", WINDOW_SIZE);
+    if (!measure("rabin_hash", parameter, bench_rabin_hash, NULL) ||
+	    !measure("rabin_hash_next", parameter, bench_rabin_hash_next,
+		     NULL) ||
+	    !measure("rabin_hash_next_48", parameter,
+		     bench_rabin_hash_next_48, NULL))
+	return 1;
+    for (i=0; i<sizeof(scan_modes)/sizeof(scan_modes[0]); i++)
+	if (!measure("scan_read_chunk", scan_modes[i].name,
+		     bench_scan_read_chunk, &scan_modes[i]))
+	    return 1;
+    for (i=0; i<sizeof(sha256_sizes)/sizeof(sha256_sizes[0]); i++) {
+	snprintf(parameter, sizeof(parameter), "%lu",
+		 (unsigned long)sha256_sizes[i]);
+	if (!measure("sha256_update", parameter, bench_sha256_update,
+		     &sha256_sizes[i]))
+	    return 1;
+    }
+
+    free(memory);
+    return 0;
+}
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
@@ -0,0 +1,125 @@
+/*
+   Copyright 2010-2011 True Blue Logic Ltd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of version 3 of the GNU General Public License as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Make the next version of a corpus by copying it from stdin to stdout
+ * with random edits: insertions and overwrites of random data, deletions,
+ * and runs of zeros written over the data. On average there are gap bytes
+ * between edits. The same seed always gives the same edits, so that a
+ * series of versions can be made again exactly.
+ *
+ * Usage: mutate seed gap < old > new */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "mt19937ar.c"
+
+#define BUFSIZE (1<<18)
+
+/* The largest edit, in bytes */
+#define MAX_EDIT (1<<16)
+
+enum edit { INSERT, DELETE, OVERWRITE, ZERO, EDITS };
+
+static unsigned char buffer[BUFSIZE];
+
+/* Copy (or if out is NULL, skip) up to length bytes of stdin. Returns the
+ * number of bytes copied, which is short only at the end of the input, or
+ * -1 on error. */
+static long long copy(FILE *out, long long length) {
+    long long done = 0;
+    size_t n;
+
+    while (done < length) {
+	n = fread(buffer, 1, length - done > BUFSIZE ? BUFSIZE : length - done,
+		  stdin);
+	if (!n) {
+	    if (ferror(stdin)) {
+		perror("fread");
+		return -1;
+	    }
+	    break;
+	}
+	if (out && fwrite(buffer, 1, n, out) != n) {
+	    perror("fwrite");
+	    return -1;
+	}
+	done += n;
+    }
+    return done;
+}
+
+/* Write length bytes of random data, or of zeros if zero is set */
+static int fill(long length, int zero) {
+    uint32_t random = 0;
+    long i;
+
+    for (i=0; i<length; i++) {
+	if (zero)
+	    buffer[i] = 0;
+	else {
+	    if (!(i & 3))
+		random = genrand_int32();
+	    buffer[i] = random >> (8 * (i & 3));
+	}
+    }
+    if (fwrite(buffer, 1, length, stdout) != length) {
+	perror("fwrite");
+	return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    long long gap, copied;
+    long length;
+    enum edit edit;
+
+    if (argc != 3) {
+	fputs("Usage: mutate seed gap < old > new\n", stderr);
+	return 2;
+    }
+    init_genrand(strtoul(argv[1], NULL, 0));
+    gap = atoll(argv[2]);
+    assert(gap > 0 && gap <= (1LL<<31));
+
+    for (;;) {
+	/* Uniform over [0, 2*gap), so that the mean gap is as asked */
+	copied = copy(stdout, ((uint64_t)genrand_int32() * gap) >> 31);
+	if (copied < 0)
+	    return 1;
+	edit = genrand_int32() % EDITS;
+	length = 1 + genrand_int32() % MAX_EDIT;
+	if (edit != INSERT && copy(NULL, length) < 0)
+	    return 1;
+	/* Don't edit past the end, so that each version is about the same
+	 * size as the last */
+	if (feof(stdin))
+	    break;
+	if (edit != DELETE && !fill(length, edit == ZERO))
+	    return 1;
+    }
+
+    if (fflush(stdout)) {
+	perror("fflush");
+	return 1;
+    }
+    return 0;
+}
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
@@ -0,0 +1,90 @@
+/*
+   Copyright 2010-2011 True Blue Logic Ltd
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of version 3 of the GNU General Public License as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Print the chunks that scan.c finds in a file in the same form as
+ * expected.1, reading it in the I/O mode given, so that every mode can be
+ * checked to give exactly the same boundaries.
+ *
+ * Usage: scan_test sync|aio|thread file */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "sha2.h"
+#include "scan.h"
+
+int main(int argc, char **argv) {
+    struct scan_ctx *scan;
+    struct scan_chunk_data chunk_data[2];
+    sha256_ctx sha256;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    unsigned long long offset = 0;
+    int fd, result, size, i;
+
+    if (argc != 3) {
+	fputs("Usage: scan_test sync|aio|thread file\n", stderr);
+	return 2;
+    }
+    fd = open(argv[2], O_RDONLY);
+    if (fd < 0) {
+	perror(argv[2]);
+	return 1;
+    }
+    scan = scan_init();
+    if (!scan) {
+	fputs("scan_init failed\n", stderr);
+	return 1;
+    }
+    scan_set_fd(scan, fd);
+    if (!strcmp(argv[1], "aio"))
+	scan_set_aio(scan);
+    else if (!strcmp(argv[1], "thread"))
+	scan_set_io_thread(scan);
+    else if (strcmp(argv[1], "sync")) {
+	fprintf(stderr, "unknown mode %s\n", argv[1]);
+	return 2;
+    }
+    if (!scan_begin(scan)) {
+	fputs("scan_begin failed\n", stderr);
+	return 1;
+    }
+
+    do {
+	result = scan_read_chunk(scan, chunk_data);
+	if (!(result & SCAN_CHUNK_FOUND)) {
+	    fputs("scan_read_chunk failed\n", stderr);
+	    return 1;
+	}
+	sha256_init(&sha256);
+	sha256_update(&sha256, chunk_data[0].buf, chunk_data[0].size);
+	if (chunk_data[1].size)
+	    sha256_update(&sha256, chunk_data[1].buf, chunk_data[1].size);
+	sha256_final(&sha256, digest);
+	size = chunk_data[0].size + chunk_data[1].size;
+
+	for (i=0; i<SHA256_DIGEST_SIZE; i++)
+	    printf("%02x", digest[i]);
+	printf(",%llu,%d\n", offset, size);
+	offset += size;
+    } while (!(result & SCAN_CHUNK_LAST));
+
+    scan_free(scan);
+    return 0;
+}
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */
@@ -0,0 +1,48 @@
+/*
+   Copyright 2010-2011 True Blue Logic Ltd
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of version 3 of the GNU General Public License as
+   published by the Free Software Foundation.
+   
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Linked into scan_test with -Wl,--wrap=fstat,--wrap=fstat64 to make every
+ * regular file look UNDERSTATED_SIZE bytes long, as a file that grows after
+ * it is opened, or one in /proc, does. scan_begin then sizes its buffer for
+ * a small file, and has to grow it when the first read does not reach EOF. */
+
+#define _LARGEFILE64_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define UNDERSTATED_SIZE 100
+
+int __real_fstat(int fd, struct stat *st);
+int __real_fstat64(int fd, struct stat64 *st);
+
+int __wrap_fstat(int fd, struct stat *st) {
+    int result = __real_fstat(fd, st);
+
+    if (!result && S_ISREG(st->st_mode))
+	st->st_size = UNDERSTATED_SIZE;
+    return result;
+}
+
+int __wrap_fstat64(int fd, struct stat64 *st) {
+    int result = __real_fstat64(fd, st);
+
+    if (!result && S_ISREG(st->st_mode))
+	st->st_size = UNDERSTATED_SIZE;
+    return result;
+}
+
+/* vim: set ts=8 sts=4 sw=4 cindent : */